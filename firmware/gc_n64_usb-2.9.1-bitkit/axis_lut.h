@@ -0,0 +1,15 @@
+#ifndef _axis_lut_h__
+#define _axis_lut_h__
+
+#include <avr/pgmspace.h>
+
+/* Axis response curves. The tables are generated from curves.txt by
+ * lutgen at build time (axis_lut.c). Each one is indexed by an axis
+ * byte and gives the report value. */
+extern const unsigned char n64_stick_lut[256] PROGMEM;
+extern const unsigned char gc_stick_lut[256] PROGMEM;
+extern const unsigned char gc_trigger_lut[256] PROGMEM;
+
+#define AXIS_LUT(table, value)	pgm_read_byte(&(table)[(unsigned char)(value)])
+
+#endif // _axis_lut_h__
@@ -0,0 +1,144 @@
+/*	gc_n64_usb : Gamecube or N64 controller to USB firmware
+	Copyright (C) 2007-2014  Raphael Assenat <raph@raphnet.net>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+/* See usbconfig.h */
+#define ADAPTER_VID		0xF055
+#define ADAPTER_PID		0x1764
+
+/* See main.c. The last value is only sent by firmware built with
+ * GCN64_TIMER_RX. */
+#define GCN64_STATS_REPORT		0x11
+#define GCN64_STATS_COUNT		11
+#define GCN64_STATS_MIN_COUNT	10
+
+static const char *names[GCN64_STATS_COUNT] = {
+	"trans", "tmout", "frame", "short", "first", "retry", "fail", "maxbit",
+	"skip", "usbcol", "rxdrop"
+};
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-i seconds] /dev/hidrawX\n", progname);
+	fprintf(stderr, "  -i  Poll every 'seconds' instead of reading once\n");
+}
+
+/* Returns the number of values read, or -1 */
+static int readStats(int fd, unsigned int *values)
+{
+	unsigned char buf[1 + GCN64_STATS_COUNT * 2];
+	int i, res;
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = GCN64_STATS_REPORT;
+
+	res = ioctl(fd, HIDIOCGFEATURE(sizeof(buf)), buf);
+	if (res < 0) {
+		perror("HIDIOCGFEATURE");
+		return -1;
+	}
+	if (res < 1 + GCN64_STATS_MIN_COUNT * 2) {
+		fprintf(stderr, "Short report (%d bytes). Old firmware?\n", res);
+		return -1;
+	}
+
+	for (i=0; i<(res - 1) / 2 && i<GCN64_STATS_COUNT; i++) {
+		values[i] = buf[1+i*2] | (buf[2+i*2] << 8);
+	}
+
+	return i;
+}
+
+int main(int argc, char **argv)
+{
+	struct hidraw_devinfo info;
+	unsigned int values[GCN64_STATS_COUNT];
+	int interval = 0;
+	int opt, fd, i, count;
+
+	while ((opt = getopt(argc, argv, "i:h")) != -1) {
+		switch (opt)
+		{
+			case 'i':
+				interval = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[optind], O_RDWR);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0) {
+		perror("HIDIOCGRAWINFO");
+		close(fd);
+		return 1;
+	}
+	if ((info.vendor & 0xffff) != ADAPTER_VID || (info.product & 0xffff) != ADAPTER_PID) {
+		fprintf(stderr, "%s is not a GC/N64 to USB adapter (%04x:%04x)\n",
+					argv[optind], info.vendor & 0xffff, info.product & 0xffff);
+		close(fd);
+		return 1;
+	}
+
+	count = readStats(fd, values);
+	if (count < 0) {
+		close(fd);
+		return 1;
+	}
+
+	for (i=0; i<count; i++) {
+		printf("%7s", names[i]);
+	}
+	printf("\n");
+
+	while (1) {
+		for (i=0; i<count; i++) {
+			printf("%7u", values[i]);
+		}
+		printf("\n");
+		fflush(stdout);
+
+		if (!interval)
+			break;
+		sleep(interval);
+
+		if (readStats(fd, values) < 0) {
+			close(fd);
+			return 1;
+		}
+	}
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,163 @@
+/*	gc_n64_usb : Gamecube or N64 controller to USB firmware
+	Copyright (C) 2007-2014  Raphael Assenat <raph@raphnet.net>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <string.h>
+
+#include "usbconfig.h"
+#include "config.h"
+
+/* Settings kept in EEPROM. Changed with a feature report (see main.c),
+ * written from the main loop (config_save) and used from the next
+ * enumeration on. */
+
+#define CONFIG_MAGIC	"GC64"
+
+struct eeprom_data_struct {
+	char magic[4];
+	unsigned int poll_rate;		// Hz
+	unsigned char interval;		// bInterval, in ms
+	unsigned char hysteresis;	// axis change threshold
+};
+
+static struct eeprom_data_struct EEMEM eeprom_data;
+static struct eeprom_data_struct config;
+static unsigned char config_dirty;
+static unsigned char config_save_pos;	// next byte config_save() writes
+
+static char config_valid(unsigned int poll_rate, unsigned char interval)
+{
+	if (poll_rate < CONFIG_MIN_POLL_RATE || poll_rate > CONFIG_MAX_POLL_RATE)
+		return 0;
+	if (interval < 1)
+		return 0;
+
+	return 1;
+}
+
+/* Polls are paced by the USB interrupts (see sched.c), so a rate above
+ * 1000/bInterval is lowered to it. The timer then does not tick for
+ * polls that would only wait for the next interrupt. */
+static unsigned int config_clampRate(unsigned int poll_rate, unsigned char interval)
+{
+	unsigned int usb_rate = 1000 / interval;
+
+	if (poll_rate > usb_rate && usb_rate >= CONFIG_MIN_POLL_RATE)
+		return usb_rate;
+
+	return poll_rate;
+}
+
+void config_init(void)
+{
+	eeprom_read_block(&config, &eeprom_data, sizeof(config));
+
+	if (memcmp(config.magic, CONFIG_MAGIC, 4) ||
+			!config_valid(config.poll_rate, config.interval)) {
+		memcpy(config.magic, CONFIG_MAGIC, 4);
+		config.hysteresis = CONFIG_DEFAULT_HYSTERESIS;
+		config.poll_rate = CONFIG_DEFAULT_POLL_RATE;
+		config.interval = CONFIG_DEFAULT_INTERVAL;
+	}
+
+	config.poll_rate = config_clampRate(config.poll_rate, config.interval);
+
+	// Not present in EEPROM written by older versions
+	if (config.hysteresis > CONFIG_MAX_HYSTERESIS)
+		config.hysteresis = CONFIG_DEFAULT_HYSTERESIS;
+}
+
+/* \brief Change the settings, to be saved with config_save(). The poll
+ * rate is lowered to 1000/interval if higher.
+ * \return 0 on success, -1 if the values are out of range.
+ */
+char config_set(unsigned int poll_rate, unsigned char interval)
+{
+	if (!config_valid(poll_rate, interval))
+		return -1;
+
+	config.poll_rate = config_clampRate(poll_rate, interval);
+	config.interval = interval;
+	config_dirty = 1;
+	config_save_pos = 0;
+
+	return 0;
+}
+
+/* Write the settings if they were changed. Each byte takes a few
+ * milliseconds, so this is not done from the USB request itself, and
+ * one byte is started per call, only once the previous one is written.
+ * The main loop never waits for the EEPROM. */
+void config_save(void)
+{
+	if (!config_dirty || !eeprom_is_ready())
+		return;
+
+	eeprom_update_byte((uint8_t*)&eeprom_data + config_save_pos,
+						((unsigned char*)&config)[config_save_pos]);
+
+	if (++config_save_pos >= sizeof(config)) {
+		config_save_pos = 0;
+		config_dirty = 0;
+	}
+}
+
+unsigned int config_getPollRate(void)
+{
+	return config.poll_rate;
+}
+
+/* The rate the controllers are actually polled at, since there is at
+ * most one poll per USB interrupt. */
+unsigned int config_getEffectivePollRate(void)
+{
+	unsigned int usb_rate = 1000 / config.interval;
+
+	return usb_rate < config.poll_rate ? usb_rate : config.poll_rate;
+}
+
+unsigned char config_getInterval(void)
+{
+	return config.interval;
+}
+
+/* Timer2 compare value (prescaler 1024, CTC) for the poll rate */
+unsigned char config_getTimerCompare(void)
+{
+	return (F_CPU / 1024 + config.poll_rate / 2) / config.poll_rate - 1;
+}
+
+/* \brief Change the axis change threshold. Used right away, saved with
+ * config_save().
+ * \return 0 on success, -1 if out of range.
+ */
+char config_setHysteresis(unsigned char hysteresis)
+{
+	if (hysteresis > CONFIG_MAX_HYSTERESIS)
+		return -1;
+
+	config.hysteresis = hysteresis;
+	config_dirty = 1;
+	config_save_pos = 0;
+
+	return 0;
+}
+
+unsigned char config_getHysteresis(void)
+{
+	return config.hysteresis;
+}
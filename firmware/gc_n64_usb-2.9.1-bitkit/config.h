@@ -0,0 +1,46 @@
+#ifndef _config_h__
+#define _config_h__
+
+#include "gcn64_protocol.h"
+#include "reportdesc.h"
+
+/* Controller poll rate limits, in Hz. The controllers are polled once
+ * per USB interrupt at most (see sched.c), so the rate is also limited
+ * to 1000/bInterval by config_set(). The upper limit is what one round
+ * of polls costs in CPU time: a GC pad takes ~400uS on the wire, port
+ * after port, and the parallel status poll takes up to ~900uS on the
+ * wire plus ~1.3ms to decode (see gcn64_transactionParallel).
+ * The lower limit is Timer2 (/1024) at its maximum period. */
+#if GCN64_NUM_PORTS > 1 && defined(GCN64_PARALLEL_POLL)
+#define CONFIG_POLL_TIME_US		(900 + 1300)
+#else
+#define CONFIG_POLL_TIME_US		(GCN64_NUM_PORTS * 400)
+#endif
+#if 1000000L / CONFIG_POLL_TIME_US < 1000
+#define CONFIG_MAX_POLL_RATE	(unsigned int)(1000000L / CONFIG_POLL_TIME_US)
+#else
+#define CONFIG_MAX_POLL_RATE	1000
+#endif
+#define CONFIG_MIN_POLL_RATE	(F_CPU / 1024 / 256 + 1)
+
+/* OCR2 = 50, the poll rate this adapter always had (~230Hz at 12MHz).
+ * Lowered to 1000/bInterval (see config.c), so the default interval
+ * gives one poll per USB interrupt. */
+#define CONFIG_DEFAULT_POLL_RATE	(F_CPU / 1024 / 51)
+#define CONFIG_DEFAULT_INTERVAL		USB_CFG_INTR_POLL_INTERVAL
+
+/* Axis change threshold (see gcn64_reportChanged), in 8-bit steps */
+#define CONFIG_MAX_HYSTERESIS		32
+#define CONFIG_DEFAULT_HYSTERESIS	1
+
+void config_init(void);
+char config_set(unsigned int poll_rate, unsigned char interval);
+void config_save(void);
+unsigned int config_getPollRate(void);
+unsigned int config_getEffectivePollRate(void);
+unsigned char config_getInterval(void);
+unsigned char config_getTimerCompare(void);
+char config_setHysteresis(unsigned char hysteresis);
+unsigned char config_getHysteresis(void);
+
+#endif // _config_h__
@@ -0,0 +1,308 @@
+/*	gc_n64_usb : Gamecube or N64 controller to USB firmware
+	Copyright (C) 2007-2014  Raphael Assenat <raph@raphnet.net>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <linux/hidraw.h>
+
+/* See usbconfig.h */
+#define ADAPTER_VID		0xF055
+#define ADAPTER_PID		0x1764
+
+/* See main.c and n64pak.h */
+#define GCN64_PAK_REPORT	0x16
+#define PAK_SIZE			0x8000
+#define PAK_BLOCK_SIZE		32
+#define PAK_REPORT_SIZE		(5 + PAK_BLOCK_SIZE)
+
+#define PAK_CMD_STOP		0
+#define PAK_CMD_READ		1
+#define PAK_CMD_WRITE		2
+
+#define PAK_ST_IDLE			0
+#define PAK_ST_BUSY			1
+#define PAK_ST_DATA			2
+#define PAK_ST_ERROR		3
+#define PAK_ST_NO_PAK		4
+
+/* Give up when the adapter makes no progress for this long */
+#define TIMEOUT_MS			2000
+
+static int port;
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-p port] backup|restore file /dev/hidrawX\n", progname);
+	fprintf(stderr, "  -p  Controller port (1 to 4), for adapters with several ports\n");
+}
+
+static long msNow(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+}
+
+/* \return 0 on success, 1 if the adapter refused (busy), -1 on error */
+static int sendCommand(int fd, int cmd, int addr, const unsigned char *data)
+{
+	unsigned char buf[PAK_REPORT_SIZE];
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = GCN64_PAK_REPORT;
+	buf[1] = cmd;
+	buf[2] = port;
+	buf[3] = addr;
+	buf[4] = addr >> 8;
+	if (data)
+		memcpy(buf + 5, data, PAK_BLOCK_SIZE);
+
+	if (ioctl(fd, HIDIOCSFEATURE(sizeof(buf)), buf) < 0) {
+		if (errno == EPIPE)
+			return 1;
+		perror("HIDIOCSFEATURE");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* \return The status, or -1 on error */
+static int getStatus(int fd, int *addr, unsigned char *data)
+{
+	unsigned char buf[PAK_REPORT_SIZE];
+	int res;
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = GCN64_PAK_REPORT;
+
+	res = ioctl(fd, HIDIOCGFEATURE(sizeof(buf)), buf);
+	if (res < 0) {
+		perror("HIDIOCGFEATURE");
+		return -1;
+	}
+	if (res < sizeof(buf)) {
+		fprintf(stderr, "Short report (%d bytes). Old firmware?\n", res);
+		return -1;
+	}
+
+	*addr = buf[3] | (buf[4] << 8);
+	if (data)
+		memcpy(data, buf + 5, PAK_BLOCK_SIZE);
+
+	return buf[1];
+}
+
+static int failed(int status, int addr)
+{
+	if (status == PAK_ST_NO_PAK)
+		fprintf(stderr, "\nNo controller pak inserted\n");
+	else if (status == PAK_ST_ERROR)
+		fprintf(stderr, "\nTransfer failed at address 0x%04x\n", addr);
+
+	return -1;
+}
+
+static void progress(int done, long start)
+{
+	long ms = msNow() - start;
+
+	printf("\r%5d / %d bytes, %ld bytes/s", done, PAK_SIZE,
+			ms ? done * 1000L / ms : 0);
+	fflush(stdout);
+}
+
+static int backup(int fd, unsigned char *image)
+{
+	int expected = 0, addr, status;
+	long start = msNow(), last = start;
+
+	if (sendCommand(fd, PAK_CMD_READ, 0, NULL))
+		return -1;
+
+	while (expected < PAK_SIZE) {
+		status = getStatus(fd, &addr, image + expected);
+		if (status < 0)
+			return -1;
+
+		switch (status)
+		{
+			case PAK_ST_DATA:
+				if (addr != expected) {
+					// A block was lost on the way. Read again from there.
+					if (sendCommand(fd, PAK_CMD_READ, expected, NULL))
+						return -1;
+					break;
+				}
+				expected += PAK_BLOCK_SIZE;
+				last = msNow();
+				if (!(expected & 0x3ff))
+					progress(expected, start);
+				break;
+
+			case PAK_ST_BUSY:
+				if (msNow() - last > TIMEOUT_MS) {
+					fprintf(stderr, "\nTimeout. Is there a N64 controller on this port?\n");
+					return -1;
+				}
+				break;
+
+			default:
+				return failed(status, addr);
+		}
+	}
+
+	printf("\n");
+	return 0;
+}
+
+static int restore(int fd, const unsigned char *image)
+{
+	int done = 0, addr, status, res;
+	long start = msNow(), last = start;
+
+	while (1) {
+		if (done < PAK_SIZE) {
+			res = sendCommand(fd, PAK_CMD_WRITE, done, image + done);
+			if (res < 0)
+				return -1;
+			if (res == 0) {
+				done += PAK_BLOCK_SIZE;
+				last = msNow();
+				if (!(done & 0x3ff))
+					progress(done, start);
+				continue;
+			}
+		}
+
+		// Queue full, or all sent: Check how it goes.
+		status = getStatus(fd, &addr, NULL);
+		if (status < 0)
+			return -1;
+		if (status == PAK_ST_IDLE && done >= PAK_SIZE)
+			break;
+		if (status != PAK_ST_IDLE && status != PAK_ST_BUSY)
+			return failed(status, addr);
+		if (msNow() - last > TIMEOUT_MS) {
+			fprintf(stderr, "\nTimeout. Is there a N64 controller on this port?\n");
+			return -1;
+		}
+	}
+
+	printf("\n");
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct hidraw_devinfo info;
+	unsigned char image[PAK_SIZE];
+	const char *action, *filename, *device;
+	FILE *fptr;
+	int opt, fd, res;
+
+	while ((opt = getopt(argc, argv, "p:h")) != -1) {
+		switch (opt)
+		{
+			case 'p':
+				port = atoi(optarg) - 1;
+				if (port < 0 || port > 3) {
+					fprintf(stderr, "Invalid port\n");
+					return 1;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind + 3 != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	action = argv[optind];
+	filename = argv[optind + 1];
+	device = argv[optind + 2];
+
+	if (strcmp(action, "backup") && strcmp(action, "restore")) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!strcmp(action, "restore")) {
+		fptr = fopen(filename, "rb");
+		if (!fptr) {
+			perror(filename);
+			return 1;
+		}
+		res = fread(image, 1, PAK_SIZE, fptr);
+		fclose(fptr);
+		if (res != PAK_SIZE) {
+			fprintf(stderr, "%s: Not a %d bytes controller pak image\n", filename, PAK_SIZE);
+			return 1;
+		}
+	}
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror(device);
+		return 1;
+	}
+
+	if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0) {
+		perror("HIDIOCGRAWINFO");
+		close(fd);
+		return 1;
+	}
+	if ((info.vendor & 0xffff) != ADAPTER_VID || (info.product & 0xffff) != ADAPTER_PID) {
+		fprintf(stderr, "%s is not a GC/N64 to USB adapter (%04x:%04x)\n",
+					device, info.vendor & 0xffff, info.product & 0xffff);
+		close(fd);
+		return 1;
+	}
+
+	if (!strcmp(action, "backup")) {
+		res = backup(fd, image);
+		if (res == 0) {
+			fptr = fopen(filename, "wb");
+			if (!fptr) {
+				perror(filename);
+				res = -1;
+			} else {
+				if (fwrite(image, 1, PAK_SIZE, fptr) != PAK_SIZE) {
+					perror(filename);
+					res = -1;
+				}
+				fclose(fptr);
+			}
+		}
+	} else {
+		res = restore(fd, image);
+	}
+
+	sendCommand(fd, PAK_CMD_STOP, 0, NULL);
+	close(fd);
+
+	return res ? 1 : 0;
+}
@@ -22,6 +22,7 @@
 #include "leds.h"
 #include "gamecube.h"
 #include "reportdesc.h"
+#include "axis_lut.h"
 #include "gcn64_protocol.h"
 
 /*********** prototypes *************/
@@ -30,17 +31,190 @@ static char gamecubeUpdate(void);
 static char gamecubeChanged(int rid);
 
 
-/* What was most recently read from the controller */
-static unsigned char last_built_report[GCN64_REPORT_SIZE];
+#ifdef GCN64_16BIT_AXES
+/* Number of polls averaged per axis value, as a power of two */
+#ifndef GC_OVERSAMPLE_SHIFT
+#define GC_OVERSAMPLE_SHIFT	2
+#endif
 
-/* What was most recently sent to the host */
-static unsigned char last_sent_report[GCN64_REPORT_SIZE];
+/* gc_pad.samples before the first poll */
+#define GC_WINDOW_EMPTY		0xff
+#endif
 
-static int gc_rumbling = 0;
-static int gc_analog_lr_disable = 0;
+/* State of the controller on each port. See gcn64_selectPort() */
+struct gc_pad {
+	/* What was most recently read from the controller */
+	unsigned char last_built_report[GCN64_REPORT_SIZE];
+
+	/* What was most recently sent to the host */
+	unsigned char last_sent_report[GCN64_REPORT_SIZE];
+	unsigned char quiet_polls;	// see gcn64_reportChanged()
+
+	int rumbling;
+	int analog_lr_disable;
+
+	/* Calibration, in report axis order: X, Y, C X, C Y, L, R.
+	 * See gamecubeCalibrate() */
+	unsigned char origin[GCN64_NUM_AXES];
+	unsigned char reach[GCN64_NUM_AXES][2];	// below, above the origin
+	unsigned int scale[GCN64_NUM_AXES][2];	// 8.8 fixed point
+	char need_origin;
+
+#ifdef GCN64_16BIT_AXES
+	/* Axes being averaged, see gamecubeOversample() */
+	unsigned char axis_hist[1 << GC_OVERSAMPLE_SHIFT][GCN64_NUM_AXES];
+	unsigned int axis_sum[GCN64_NUM_AXES];
+	unsigned char samples;	// next slot in axis_hist
+#endif
+};
+
+static struct gc_pad gc_pads[GCN64_NUM_PORTS];
+
+/* Deflection from the origin giving a full scale value, until the
+ * controller is seen going further. */
+#define GC_STICK_REACH		90
+#define GC_TRIGGER_REACH	180
+
+/* Axes 0-3 are sticks, 4 and 5 the analog triggers */
+#define GC_IS_TRIGGER(axis)	((axis) >= 4)
+
+/* Y axes are inverted in reports. One bit per axis. */
+#define GC_INVERTED_AXES	0x0a
+
+/* Furthest plausible origin: from 0x80 for sticks, from 0 for triggers.
+ * Anything else means an axis was held when the origin was taken. */
+#define GC_STICK_ORIGIN_SPAN	0x30
+#define GC_TRIGGER_ORIGIN_MAX	0x50
+
+static void gamecubeSetReach(struct gc_pad *pad, unsigned char axis, unsigned char side, unsigned char reach)
+{
+	// 127 (sticks) or 255 (triggers) at full reach, rounded up so it is
+	// really reached. Never overflows as deflections are at most the
+	// reach.
+	unsigned int full = GC_IS_TRIGGER(axis) ? 0xff00 : 0x7f00;
+
+	pad->reach[axis][side] = reach;
+	pad->scale[axis][side] = (full + reach - 1) / reach;
+}
+
+static void gamecubeResetCalibration(struct gc_pad *pad)
+{
+	unsigned char i, reach;
+
+	for (i=0; i<GCN64_NUM_AXES; i++) {
+		reach = GC_IS_TRIGGER(i) ? GC_TRIGGER_REACH : GC_STICK_REACH;
+		pad->origin[i] = GC_IS_TRIGGER(i) ? 0x00 : 0x80;
+		gamecubeSetReach(pad, i, 0, reach);
+		gamecubeSetReach(pad, i, 1, reach);
+	}
+	pad->need_origin = 1;
+}
+
+/* Send an origin command and check the reply. Returns 0 and the axes
+ * in origin[] if they are plausible neutral values. */
+static char gamecubeReadOrigin(unsigned char *cmd, unsigned char cmdlen, unsigned char *origin)
+{
+	unsigned char i;
+
+	if (gcn64_transaction(cmd, cmdlen, GC_ORIGIN_REPLY_LENGTH) != GC_ORIGIN_REPLY_LENGTH)
+		return -1;
+
+	// Same layout as the status reply: axes from bit 16.
+	gcn64_protocol_getBytes(16, GCN64_NUM_AXES, origin);
+
+	for (i=0; i<GCN64_NUM_AXES; i++) {
+		if (GC_IS_TRIGGER(i)) {
+			if (origin[i] > GC_TRIGGER_ORIGIN_MAX)
+				return -1;
+		} else {
+			if (origin[i] < 0x80 - GC_STICK_ORIGIN_SPAN ||
+					origin[i] > 0x80 + GC_STICK_ORIGIN_SPAN)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Read the neutral axis values. Recalibrate also returns them and is
+ * tried if get origin is not supported or gives implausible values.
+ * If both fail, the current origin is kept until the controller asks
+ * again (status bit 2). */
+static void gamecubeGetOrigin(struct gc_pad *pad)
+{
+	unsigned char cmd[3];
+	unsigned char origin[GCN64_NUM_AXES];
+
+	pad->need_origin = 0;
+
+	cmd[0] = GC_GETORIGIN;
+	if (gamecubeReadOrigin(cmd, 1, origin)) {
+		cmd[0] = GC_RECALIBRATE1;
+		cmd[1] = GC_RECALIBRATE2;
+		cmd[2] = GC_RECALIBRATE3;
+		if (gamecubeReadOrigin(cmd, 3, origin))
+			return;
+	}
+
+	memcpy(pad->origin, origin, GCN64_NUM_AXES);
+}
+
+/* Center and scale the raw axis values in report[1..6]: the origin
+ * becomes 0x80 and the reach 0x80 +/- 127. Going past the known reach
+ * extends it, so every controller gets full range once each direction
+ * was pushed fully.
+ *
+ * Triggers use the full range from their origin: 0xff at rest down to
+ * 0x00 fully pushed, the polarity this adapter always reported. */
+static void gamecubeCalibrate(struct gc_pad *pad, unsigned char *report)
+{
+	unsigned char i, side, d;
+	unsigned int v;
+	int delta;
+
+	for (i=0; i<GCN64_NUM_AXES; i++) {
+		delta = report[1 + i] - pad->origin[i];
+		side = delta >= 0;
+		d = side ? delta : -delta;
+
+		if (GC_IS_TRIGGER(i) && !side) {
+			// Below the rest value
+			side = 1;
+			d = 0;
+		}
+
+		if (d > pad->reach[i][side])
+			gamecubeSetReach(pad, i, side, d);
+
+		v = (d * pad->scale[i][side]) >> 8;
+
+		// Deadzone and response curve (see curves.txt)
+		if (GC_IS_TRIGGER(i)) {
+			v = AXIS_LUT(gc_trigger_lut, v) ^ 0xff;
+		} else {
+			v = side ? 0x80 + v : 0x80 - v;
+			v = AXIS_LUT(gc_stick_lut, v);
+		}
+
+		if (GC_INVERTED_AXES & (1 << i))
+			v ^= 0xff;
+
+		report[1 + i] = v;
+	}
+}
 
 static void gamecubeInit(void)
 {
+	struct gc_pad *pad = &gc_pads[gcn64_getPort()];
+
+	gamecubeResetCalibration(pad);
+
+#ifdef GCN64_16BIT_AXES
+	pad->samples = GC_WINDOW_EMPTY;
+	memset(pad->last_built_report + 1, 0x7f, GCN64_BUTTONS_OFFSET - 1);
+#endif
+
+	gcn64_housekeepingNow();
 	if (0 == gamecubeUpdate()) {
 		unsigned char btns2;
 
@@ -48,46 +222,124 @@ static void gamecubeInit(void)
 
 		//if (gcn64_workbuf[GC_BTN_L] && gcn64_workbuf[GC_BTN_R]) {
 		if ((btns2 & 0x06) == 0x06) { // L + R
-			gc_analog_lr_disable = 1;
+			pad->analog_lr_disable = 1;
 		} else {
-			gc_analog_lr_disable = 0;
+			pad->analog_lr_disable = 0;
 		}
 	}
 }
 
-static char gamecubeUpdate(void)
+static char gamecubeBuildPoll(unsigned char *cmd)
 {
-	int i;
+	struct gc_pad *pad = &gc_pads[gcn64_getPort()];
 	unsigned char tmp=0;
-	unsigned char tmpdata[8];	
 	unsigned char count;
-	unsigned char x,y,cx,cy,rtrig,ltrig,btns1,btns2,rb1,rb2;
-	
+
 	/* Get ID command.
 	 * 
 	 * If we don't do that, the wavebird does not work.  
+	 *
+	 * Not needed at each poll though. A wavebird which is not answering
+	 * status polls (e.g. it was just turned on) makes them fail, and
+	 * a failure brings the ID command back at the next poll.
 	 */
-	tmp = GC_GETID;
-	count = gcn64_transaction(&tmp, 1);
-	if (count != GC_GETID_REPLY_LENGTH) {
-		return 1;
+	if (gcn64_housekeepingDue()) {
+		tmp = GC_GETID;
+		count = gcn64_transaction(&tmp, 1, GC_GETID_REPLY_LENGTH);
+		if (count != GC_GETID_REPLY_LENGTH) {
+			return 1;
+		}
 	}
 
-	tmpdata[0] = GC_GETSTATUS1;
-	tmpdata[1] = GC_GETSTATUS2;
-	tmpdata[2] = GC_GETSTATUS3(gc_rumbling);
+	if (pad->need_origin)
+		gamecubeGetOrigin(pad);
 
-	count = gcn64_transaction(tmpdata, 3);
-	if (count != GC_GETSTATUS_REPLY_LENGTH) {
-		return 1; // failure
+	cmd[0] = GC_GETSTATUS1;
+	cmd[1] = GC_GETSTATUS2;
+	cmd[2] = GC_GETSTATUS3(pad->rumbling);
+
+	return 0;
+}
+
+/* Where each bit of the status reply goes in the report.
+ * See gcn64_scatterReply() */
+static const unsigned char gc_status_scatter[] PROGMEM = {
+	// 0-1: Always 0, 2: Origin flag, 3-7: St Y X B A
+	GCN64_SCATTER_NONE, GCN64_SCATTER_NONE, GCN64_SCATTER_NONE,
+	GCN64_SCATTER_BIT(7, 0x01), GCN64_SCATTER_BIT(7, 0x02), GCN64_SCATTER_BIT(7, 0x04),
+	GCN64_SCATTER_BIT(7, 0x08), GCN64_SCATTER_BIT(7, 0x10),
+	// 8: Always 1, 9-11: L R Z, 12-15: Up,Down,Right,Left
+	GCN64_SCATTER_NONE,
+	GCN64_SCATTER_BIT(7, 0x20), GCN64_SCATTER_BIT(7, 0x40), GCN64_SCATTER_BIT(7, 0x80),
+	GCN64_SCATTER_BIT(8, 0x01), GCN64_SCATTER_BIT(8, 0x02), GCN64_SCATTER_BIT(8, 0x04),
+	GCN64_SCATTER_BIT(8, 0x08),
+	// Raw axes, see gamecubeCalibrate()
+	GCN64_SCATTER_BYTE(1, 0x00), // Joy X
+	GCN64_SCATTER_BYTE(2, 0x00), // Joy Y
+	GCN64_SCATTER_BYTE(3, 0x00), // C Joystick X
+	GCN64_SCATTER_BYTE(4, 0x00), // C Joystick Y
+	GCN64_SCATTER_BYTE(5, 0x00), // Left Btn Val
+	GCN64_SCATTER_BYTE(6, 0x00), // Right Btn Val
+};
+
+#ifdef GCN64_16BIT_AXES
+/* Buttons are copied right away. Each axis is the average of the last
+ * 1 << GC_OVERSAMPLE_SHIFT polls (a moving window), so the report gets
+ * new axis values at every poll, once per USB interrupt at most (see
+ * sched.c). Averaging adds GC_OVERSAMPLE_SHIFT bits of resolution (the
+ * stick noise acts as dither) and a value flickering between two LSBs
+ * moves the average by less than the report threshold. The window is
+ * filled with the first poll so it does not start from zero. */
+static void gamecubeOversample(struct gc_pad *pad, const unsigned char *raw)
+{
+	unsigned char i, j;
+	unsigned int sum;
+
+	pad->last_built_report[0] = raw[0];
+	pad->last_built_report[GCN64_BUTTONS_OFFSET] = raw[7];
+	pad->last_built_report[GCN64_BUTTONS_OFFSET + 1] = raw[8];
+
+	if (pad->samples == GC_WINDOW_EMPTY) {
+		for (i=0; i<GCN64_NUM_AXES; i++) {
+			for (j=0; j<(1 << GC_OVERSAMPLE_SHIFT); j++) {
+				pad->axis_hist[j][i] = raw[1 + i];
+			}
+			pad->axis_sum[i] = raw[1 + i] << GC_OVERSAMPLE_SHIFT;
+		}
+		pad->samples = 0;
 	}
-	
+
+	for (i=0; i<GCN64_NUM_AXES; i++) {
+		sum = pad->axis_sum[i] - pad->axis_hist[pad->samples][i] + raw[1 + i];
+		pad->axis_hist[pad->samples][i] = raw[1 + i];
+		pad->axis_sum[i] = sum;
+
+		// sum * 257 / samples: full scale is 0xffff
+		sum = (sum << (8 - GC_OVERSAMPLE_SHIFT)) + (sum >> GC_OVERSAMPLE_SHIFT);
+		pad->last_built_report[1 + i*2] = sum;
+		pad->last_built_report[2 + i*2] = sum >> 8;
+	}
+	pad->samples = (pad->samples + 1) & ((1 << GC_OVERSAMPLE_SHIFT) - 1);
+}
+#endif
+
+static char gamecubeParsePoll(void)
+{
+	struct gc_pad *pad = &gc_pads[gcn64_getPort()];
+#ifdef GCN64_16BIT_AXES
+	unsigned char raw[1 + GCN64_NUM_AXES + 2];
+	unsigned char *report = raw;
+#else
+	unsigned char *report = pad->last_built_report;
+#endif
+
 /*
 	(Source: Nintendo Gamecube Controller Protocol
 		updated 8th March 2004, by James.)
 
 	Bit		Function
-	0-2		Always 0 
+	0-1		Always 0 
+	2		Origin flag (get origin again)
 	3		Start
 	4		Y
 	5		X
@@ -105,44 +357,45 @@ static char gamecubeUpdate(void)
 	48-55	Left Btn Val
 	56-63	Right Btn Val
  */
-	
-	btns1 = gcn64_protocol_getByte(0);
-	btns2 = gcn64_protocol_getByte(8);
-	x = gcn64_protocol_getByte(16);
-	y = gcn64_protocol_getByte(24);
-	cx = gcn64_protocol_getByte(32);
-	cy = gcn64_protocol_getByte(40);
-	ltrig = gcn64_protocol_getByte(48);
-	rtrig = gcn64_protocol_getByte(56);
-
-	/* Prepare button bits */
-	rb1 = rb2 = 0;
-	for (i=0; i<5; i++) // St Y X B A
-		rb1 |= (btns1 & (0x10 >> i)) ? (0x01<<i) : 0;
-	for (i=0; i<3; i++) // L R Z
-		rb1 |= (btns2 & (0x40 >> i)) ? (0x20<<i) : 0;
-	for (i=0; i<4; i++) // Up,Down,Right,Left
-		rb2 |= (btns2 & (0x08 >> i)) ? (0x01<<i) : 0;
-
-	if (gc_analog_lr_disable) {
-		ltrig = 0x7f;
-		rtrig = 0x7f;
+
+	report[0] = gcn64_getPort() + 1; // report ID
+	report[7] = 0;
+	report[8] = 0;
+	gcn64_scatterReply(gc_status_scatter, report, GC_GETSTATUS_REPLY_LENGTH / 8);
+
+	if (gcn64_protocol_getByte(0) & GC_STATUS_ORIGIN_FLAG)
+		pad->need_origin = 1;
+
+	gamecubeCalibrate(pad, report);
+
+	if (pad->analog_lr_disable) {
+		report[5] = 0xff; // released
+		report[6] = 0xff;
 	}
 
-	last_built_report[0] = 1; // report ID
-	last_built_report[1] = x;
-	last_built_report[2] = y ^ 0xff;
-	last_built_report[3] = cx;
-	last_built_report[4] = cy ^ 0xff;
-	// Sliders value to decrease as pushed (v2.x behaviour)
-	last_built_report[5] = ltrig ^ 0xff;
-	last_built_report[6] = rtrig ^ 0xff;
-	last_built_report[7] = rb1;
-	last_built_report[8] = rb2;
+#ifdef GCN64_16BIT_AXES
+	gamecubeOversample(pad, raw);
+#endif
 
 	return 0; // success
 }
 
+static char gamecubeUpdate(void)
+{
+	unsigned char tmpdata[3];
+	unsigned char count;
+
+	if (gamecubeBuildPoll(tmpdata))
+		return 1;
+
+	count = gcn64_transactionRetry(tmpdata, 3, GC_GETSTATUS_REPLY_LENGTH);
+	if (count != GC_GETSTATUS_REPLY_LENGTH) {
+		return 1; // failure
+	}
+
+	return gamecubeParsePoll();
+}
+
 static char gamecubeProbe(void)
 {
 	if (0 == gamecubeUpdate())
@@ -153,21 +406,28 @@ static char gamecubeProbe(void)
 
 static char gamecubeChanged(int id)
 {
-	return memcmp(last_built_report, last_sent_report, GCN64_REPORT_SIZE);
+	struct gc_pad *pad = &gc_pads[gcn64_getPort()];
+
+	return gcn64_reportChanged(pad->last_built_report, pad->last_sent_report,
+								&pad->quiet_polls);
 }
 
 static int gamecubeBuildReport(unsigned char *reportBuffer, int id)
 {
+	struct gc_pad *pad = &gc_pads[gcn64_getPort()];
+
 	if (reportBuffer != NULL)
-		memcpy(reportBuffer, last_built_report, GCN64_REPORT_SIZE);
+		memcpy(reportBuffer, pad->last_built_report, GCN64_REPORT_SIZE);
 	
-	memcpy(last_sent_report, last_built_report, GCN64_REPORT_SIZE);	
+	memcpy(pad->last_sent_report, pad->last_built_report, GCN64_REPORT_SIZE);	
 	return GCN64_REPORT_SIZE;
 }
 
 static void gamecubeVibration(int value)
 {
-	gc_rumbling = value;
+	struct gc_pad *pad = &gc_pads[gcn64_getPort()];
+
+	pad->rumbling = value;
 }
 
 static Gamepad GamecubeGamepad = {
@@ -178,6 +438,10 @@ static Gamepad GamecubeGamepad = {
 	.buildReport			= gamecubeBuildReport,
 	.probe					= gamecubeProbe,
 	.setVibration			= gamecubeVibration,
+	.buildPoll				= gamecubeBuildPoll,
+	.parsePoll				= gamecubeParsePoll,
+	.pollLength				= 3,
+	.pollReplyBits			= GC_GETSTATUS_REPLY_LENGTH,
 };
 
 Gamepad *gamecubeGetGamepad(void)
@@ -1,14 +1,19 @@
 #ifndef _gamepad_h__
 #define _gamepad_h__
 
+/* USB interfaces (see my_usbDescriptorConfiguration in main.c). The
+ * keyboard interface only exists on single port adapters. */
+#define GAMEPAD_INTF_JOYSTICK	0
+#define GAMEPAD_INTF_KEYBOARD	1
+
 typedef struct {
 	int num_reports;
 
 	int reportDescriptorSize;
 	void *reportDescriptor; // must be in flash
 
-	int deviceDescriptorSize; // if 0, use default
-	void *deviceDescriptor; // must be in flash
+	/* Where the reports go. GAMEPAD_INTF_JOYSTICK (0) unless set. */
+	unsigned char usb_interface;
 	
 	void (*init)(void);
 	char (*update)(void);
@@ -18,6 +23,22 @@ typedef struct {
 
 	/* Check for the controller */
 	char (*probe)(void); /* return true if found */
+
+	/* Optional. update() split around the status poll, so the pads of
+	 * the same type can be polled at once (gcn64_transactionParallel).
+	 * buildPoll stores the status command (pollLength bytes) and returns
+	 * non-zero on error. parsePoll processes the reply (pollReplyBits). */
+	char (*buildPoll)(unsigned char *cmd);
+	char (*parsePoll)(void);
+	int pollLength;
+	int pollReplyBits;
+
+	/* Optional. Slow controller traffic which is not needed to read the
+	 * controller (e.g. rumble pak writes). Called after the status poll,
+	 * once the report is published, when there is time for it before
+	 * the next USB interrupt, or else right after an interrupt every few
+	 * polls (runAfterPoll in main.c). */
+	void (*afterPoll)(void);
 } Gamepad;
 
 #endif // _gamepad_h__
@@ -1,4 +1,7 @@
 #include "gamepad.h"
 
+/* Boot keyboard report: modifiers, reserved, 6 keys */
+#define GC_KB_REPORT_SIZE	8
+
 Gamepad *gc_kb_getGamepad(void);
 
@@ -15,64 +15,53 @@
 	along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 
 #include "gcn64_protocol.h"
+#include "sched.h"
 
 #undef FORCE_KEYBOARD
 
-#define GCN64_BUF_SIZE	300
-static volatile unsigned char gcn64_workbuf[GCN64_BUF_SIZE];
+/* Replies are decoded while they arrive and transmission reads the
+ * caller's buffer directly, so only the packed reply bytes need to be
+ * stored. The longest reply (expansion read: 32 data bytes and a CRC) fits.
+ * One buffer per port, as gcn64_transactionParallel() receives from all
+ * ports at once. */
+#define GCN64_BUF_SIZE	40
+static volatile unsigned char gcn64_workbuf[GCN64_NUM_PORTS][GCN64_BUF_SIZE];
 
 /******** IO port definitions **************/
 #define GCN64_DATA_PORT	PORTC
 #define GCN64_DATA_DDR	DDRC
 #define GCN64_DATA_PIN	PINC
-#define GCN64_DATA_BIT	(1<<3)
 
-/*
- * \brief Explode bytes to bits
- * \param bytes 	The input byte array
- * \param num_bytes	The number of input bytes
- * \param workbuf_bit_offset	The offset to start writing at
- * \return number of bits (i.e. written output bytes)
- *
- * 1 input byte = 8 output bytes, where each output byte is zero or non-zero depending
- * on the input byte bits, starting with the most significant one.
- */
-static int bitsToWorkbufBytes(unsigned char *bytes, int num_bytes, int workbuf_bit_offset)
-{
-	int i, bit;
-	unsigned char p;
-
-	if (num_bytes * 8 > GCN64_BUF_SIZE)
-		return 0;
+/* Port 1 uses PC3, then PC2, PC1 and PC0 (like 4nes4snes) */
+#define GCN64_DATA_BITNUM(port)	(3 - (port))
+#define GCN64_DATA_MASK			(((1 << GCN64_NUM_PORTS) - 1) << (4 - GCN64_NUM_PORTS))
 
-	for (i=0,bit=0; i<num_bytes; i++) {
-		for (p=0x80; p; p>>=1) {
-			gcn64_workbuf[bit+workbuf_bit_offset] = bytes[i] & p;
-			bit++;
-		}
-	}	
+#if GCN64_NUM_PORTS < 1 || GCN64_NUM_PORTS > 4
+#error GCN64_NUM_PORTS must be between 1 and 4
+#endif
 
-	return bit;
-}
+#if GCN64_NUM_PORTS > 1
+static unsigned char gcn64_port;
+#else
+#define gcn64_port	0
+#endif
 
-/* Read a byte from the buffer (where 1 byte is 1 bit).
- * MSb first.
+/* Read a byte from the reply buffer. Replies are stored packed, MSb first,
+ * so offset is still expressed in bits.
  */
 unsigned char gcn64_protocol_getByte(int offset)
 {
-	unsigned char val, b;
-	unsigned char volatile *addr = gcn64_workbuf + offset;
+	unsigned char sh = offset & 7;
+	unsigned char volatile *addr = gcn64_workbuf[gcn64_port] + (offset >> 3);
 
-	for (b=0x80, val=0; b; b>>=1)
-	{
-		if (*addr)
-			val |= b;
-		addr++;
-	}
-	return val;
+	if (!sh)
+		return *addr;
+
+	return (addr[0] << sh) | (addr[1] >> (8 - sh));
 }
 
 void gcn64_protocol_getBytes(int offset, int n_bytes, unsigned char *dstbuf)
@@ -85,155 +74,700 @@ void gcn64_protocol_getBytes(int offset, int n_bytes, unsigned char *dstbuf)
 	}
 }
 
+/* \brief Copy a reply straight to its final place in a report.
+ * \param table Where each reply byte or bit goes (see GCN64_SCATTER_BYTE)
+ * \param dst The report. Bytes receiving bits must be cleared first.
+ * \param n_bytes The reply length in bytes
+ *
+ * Replaces gcn64_protocol_getByte() calls followed by loops moving the
+ * button bits one by one. Axes are copied (and inverted) whole, and only
+ * the bits of button bytes are looked up. The bit tests are unrolled.
+ */
+void gcn64_scatterReply(const unsigned char *table, unsigned char *dst, unsigned char n_bytes)
+{
+	unsigned char volatile *src = gcn64_workbuf[gcn64_port];
+	unsigned char b, n;
+
+	while (n_bytes--) {
+		b = *src++;
+		n = pgm_read_byte(table);
+
+		if (n & 0x80) {
+			dst[n & 0x7f] = b ^ pgm_read_byte(table + 1);
+			table += 2;
+			continue;
+		}
+
+#define SCATTER_BIT(i)	if (b & (0x80 >> (i))) \
+							dst[pgm_read_byte(table + (i) * 2)] |= pgm_read_byte(table + (i) * 2 + 1)
+		SCATTER_BIT(0);
+		SCATTER_BIT(1);
+		SCATTER_BIT(2);
+		SCATTER_BIT(3);
+		SCATTER_BIT(4);
+		SCATTER_BIT(5);
+		SCATTER_BIT(6);
+		SCATTER_BIT(7);
+		table += 16;
+	}
+}
+
+static struct gcn64_stats gcn64_stats;
+
+/* Polls left before the next housekeeping command. 0 means due. */
+static unsigned char gcn64_housekeeping_countdown[GCN64_NUM_PORTS];
+
+/* Value of 'left' when the receivers gave up waiting for a reply */
+#define RX_NO_REPLY		0xff
+
+/* \brief Compute the reply length, storing a partial last byte if any.
+ * \param ptr Where the receiver would have stored the next byte
+ * \param left Space that was left in the reply buffer. RX_NO_REPLY if
+ *             the controller did not answer.
+ * \param cur The byte being received, with its sentinel bit. 0 on error.
+ * \return The number of bits received, 0 on error.
+ */
+static unsigned int gcn64_receiveEnd(unsigned char volatile *ptr, unsigned char left, unsigned char cur)
+{
+	unsigned int bits;
+
+	if (!cur) {
+		if (left == RX_NO_REPLY) {
+			gcn64_stats.timeouts++;
+		} else {
+			gcn64_stats.framing_errors++;
+		}
+		return 0;
+	}
+
+	bits = (ptr - gcn64_workbuf[gcn64_port]) * 8;
+
+	// Store an incomplete last byte, left aligned.
+	if (cur != 0x01 && left) {
+		unsigned char n = 7;
+
+		while (!(cur & 0x80)) {
+			cur <<= 1;
+			n--;
+		}
+		gcn64_workbuf[gcn64_port][bits / 8] = cur << 1;
+		bits += n;
+	}
+
+	return bits;
+}
+
+/* Bytes to receive before returning */
+static unsigned char gcn64_bytesToReceive(int expected_bits)
+{
+	if (expected_bits > 0 && expected_bits <= GCN64_BUF_SIZE * 8 && !(expected_bits & 7)) {
+		return expected_bits / 8;
+	}
+	return GCN64_BUF_SIZE;
+}
+
+/* Wire timings in CPU cycles, rounded to the nearest cycle. Everything
+ * below is derived from these and F_CPU, so the firmware can be built
+ * for other clocks (make F_CPU=16000000L). At 16.5MHz the bits come out
+ * 1/17 and 3/50 cycles, 1.03uS and 3.03uS.
+ */
+#define GCN64_CYCLES(ns)	((F_CPU / 1000L * (ns) + 500000L) / 1000000L)
+#define GCN64_T_SHORT		GCN64_CYCLES(1000)	// 1uS
+#define GCN64_T_LONG		GCN64_CYCLES(3000)	// 3uS
+
+// gcn64_sendBytes needs 9 cycles of overhead in the short high level of a 0.
+#if GCN64_T_SHORT < 9
+#error F_CPU too low for gcn64 bit timings
+#endif
+
 // The bit timeout is a counter to 127. This is the 
 // start value. Counting from 0 takes hundreads of 
 // microseconds. Because of this, the reception function
 // "hangs in there" much longer than necessary..
-#define TIMING_OFFSET	100 // gives about 12uS. Twice the expected maximum bit period.
+// One count is 5 cycles. About 12uS, twice the expected maximum bit period.
+// (100 at 12MHz)
+#define TIMING_OFFSET	(128 - GCN64_CYCLES(12000) / 5)
 
-static unsigned char gcn64_receive()
-{
-	register unsigned char count=0;
+#if TIMING_OFFSET < 1
+#error F_CPU too high for the gcn64 receive timeout counter
+#endif
 
-#define SET_DBG	"	sbi %3, 4		\n"
-#define CLR_DBG	"	cbi %3, 4		\n"
+/* Limit for the calibrated bias. At 12MHz, low minus high is about -5
+ * for a 1 and +5 for a 0 (loop iterations), twice that on HORI pads. */
+#define GCN64_MAX_BIAS	16
+
+static struct gcn64_timing_profile gcn64_profile[GCN64_NUM_PORTS];
+
+#ifndef GCN64_TIMER_RX
+/* \brief Receive a reply, deciding each bit as it arrives.
+ * \param expected_bits The reply length, or 0 if unknown.
+ * \return The number of bits received (stop bit excluded), 0 on timeout/error.
+ *
+ * The result is in gcn64_workbuf, packed, MSb first.
+ *
+ *          ________
+ * ________/
+ *
+ *   low     high
+ *
+ *                      ____
+ * 0 : ________________/
+ *          ________________
+ * 1 : ____/
+ *
+ * The timings on a real N64 are
+ *
+ * 0 : 3 us low, 1 us high
+ * 1 : 1 us low, 3 us high
+ *
+ * However, HORI pads use something similar to
+ *
+ * 0 : 4.5 us low, 1.5 us high
+ * 1 : 1.5 us low, 4.5 us high
+ *
+ * So rather than using fixed thresholds, the length of the low level is
+ * compared to the length of the high level which follows it. The high
+ * level count starts gcn64_profile[].bias higher, so a controller with
+ * lopsided timings can be given a threshold of its own (see
+ * gcn64_calibrate()). With a bias of 0, 1 is simply low < high. This
+ * can only be done when the next falling edge is seen, so the decision
+ * (and storing a byte every 8 bits) happens right after a falling edge,
+ * at the beginning of the low level of the next bit. The counter for that
+ * low level starts a little higher to compensate for the extra cycles
+ * used by the store.
+ *
+ * Each byte is assembled from a sentinel bit: when it reaches the carry,
+ * 8 bits have been shifted in.
+ *
+ * The stop bit is a short (~1us) low state followed by an "infinite"
+ * high state. When the reply length is known (and a multiple of 8), the
+ * function returns as soon as the stop bit ends. Otherwise the high state
+ * timeouts (~12uS) and lets the function return.
+ *
+ * Cycles spent between receiving the last bit and getting the packed
+ * data in gcn64_workbuf, on a 64 bit gamecube reply, at 12 MHz:
+ *
+ *  Before: decode ~1200 (~100uS), + ~100 per gcn64_protocol_getByte
+ *  Now: 0, + ~10 per gcn64_protocol_getByte
+ */
+static inline __attribute__((always_inline))
+unsigned int gcn64_receivePin(int expected_bits, unsigned char bit)
+{
+	unsigned char left = gcn64_bytesToReceive(expected_bits);
+	unsigned char cur;
+	unsigned char high_start = TIMING_OFFSET + gcn64_profile[gcn64_port].bias;
+	unsigned char volatile *ptr = gcn64_workbuf[gcn64_port];
 
 	// The data line has been released. 
 	// The receive part below expects it to be still high
 	// and will wait for it to become low before beginning
 	// the counting.
 	asm volatile(
-		"	push r30				\n"	// save Z
-		"	push r31				\n"	// save Z
-		
-		"	clr %0					\n"
+		"	ldi %1, 0x01			\n" // sentinel
 		"	clr r16					\n"
-"initial_wait_low:\n"
+"rx_initial_wait_low%=:\n"
 		"	inc r16					\n"
-		"	breq timeout			\n" // overflow to 0
-		"	sbic %2, 3				\n"
-		"	rjmp initial_wait_low	\n"
+		"	breq rx_timeout%=		\n" // overflow to 0
+		"	sbic %3, %7				\n"
+		"	rjmp rx_initial_wait_low%=	\n"
 
-		// the next transition is to a high bit	
-		"	rjmp waithigh			\n"
-
-"waitlow:\n"
+		// time the low level
+"rx_waithigh%=:\n"
 		"	ldi r16, %4				\n"
-"waitlow_lp:\n"
+"rx_waithigh_lp%=:\n"
 		"	inc r16					\n"
-		"	brmi timeout			\n" // > 127 (approx 50uS timeout)
-		"	sbic %2, 3				\n"
-		"	rjmp waitlow_lp			\n"
-	
-		"	inc %0					\n" // count this timed low level
-		"	breq overflow			\n" // > 255
-		"	st z+,r16				\n"
-
-"waithigh:\n"
+		"	brmi rx_error%=			\n" // > 127 (line stuck low)
+		"	sbis %3, %7				\n"
+		"	rjmp rx_waithigh_lp%=	\n"
+		"	mov r17, r16			\n"
+
+		// time the high level. Timing out here is the stop bit.
+		"	mov r16, %6				\n"
+"rx_waitlow_lp%=:\n"
+		"	inc r16					\n"
+		"	brmi rx_done%=			\n" // > 127
+		"	sbic %3, %7				\n"
+		"	rjmp rx_waitlow_lp%=	\n"
+
+		// the next bit has started. Decide this one.
+		"	cp r17, r16				\n" // carry set if low < high
+		"	rol %1					\n"
+		"	brcc rx_waithigh%=		\n" // sentinel not out yet
+		"	st z+, %1				\n"
+		"	ldi %1, 0x01			\n"
+		"	dec %0					\n"
+		"	breq rx_last%=			\n" // got everything
+		"	ldi r16, %5				\n" // the above took ~1 iteration
+		"	rjmp rx_waithigh_lp%=	\n"
+
+		// The last byte is in. The line is low because of the stop
+		// bit: wait until it ends instead of waiting for a timeout.
+"rx_last%=:\n"
 		"	ldi r16, %4				\n"
-"waithigh_lp:\n"
+"rx_last_lp%=:\n"
 		"	inc r16					\n"
-		"	brmi timeout			\n" // > 127
-		"	sbis %2, 3				\n"
-		"	rjmp waithigh_lp		\n"
-	
-		"	inc %0					\n" // count this timed high level
-		"	breq overflow			\n" // > 255
-		"	st z+,r16				\n"
-
-		"	rjmp waitlow			\n"
-
-"overflow:  \n"
-"timeout:	\n"
-"			pop r31				\n" // restore z
-"			pop r30				\n" // restore z
-
-		: 	"=&r" (count)						// %0
-		: 	"z" ((unsigned char volatile *)gcn64_workbuf),		// %1
-			"I" (_SFR_IO_ADDR(GCN64_DATA_PIN)),	// %2
-			"I" (_SFR_IO_ADDR(PORTB)),			// %3
-			"M" (TIMING_OFFSET)					// %4
-		: 	"r16"
+		"	brmi rx_error%=			\n"
+		"	sbis %3, %7				\n"
+		"	rjmp rx_last_lp%=		\n"
+		"	rjmp rx_done%=			\n"
+
+"rx_timeout%=:\n"
+		"	clr %0					\n" // RX_NO_REPLY
+		"	dec %0					\n"
+"rx_error%=:\n"
+		"	clr %1					\n"
+"rx_done%=:\n"
+		: 	"+r" (left),						// %0
+			"=&d" (cur),						// %1
+			"+z" (ptr)							// %2
+		: 	"I" (_SFR_IO_ADDR(GCN64_DATA_PIN)),	// %3
+			"M" (TIMING_OFFSET),				// %4
+			"M" (TIMING_OFFSET + 1),			// %5
+			"r" (high_start),					// %6
+			"I" (bit)							// %7
+		: 	"r16", "r17"
 	);
 
-	return count;
+	return gcn64_receiveEnd(ptr, left, cur);
 }
+#endif // !GCN64_TIMER_RX
 
-static void gcn64_sendBytes(unsigned char *data, unsigned char n_bytes)
+#ifdef GCN64_TIMER_RX
+static unsigned int gcn64_rx_collisions;
+
+unsigned int gcn64_getCollisionCount(void)
 {
-	unsigned int bits;
+	return gcn64_rx_collisions;
+}
 
-	if (n_bytes == 0)
-		return;
+/* Cycles from a falling edge to the instant the bit value is sampled,
+ * minus what the receiver below spends before it. About 2uS. */
+#define RX_SAMPLE_NOPS	(GCN64_CYCLES(2000) - 19)
+
+/* Time between falling edges above which edges were lost. About 10uS. */
+#define RX_GAP_CYCLES	GCN64_CYCLES(10000)
+
+#if RX_SAMPLE_NOPS < 0
+#error F_CPU too low for GCN64_TIMER_RX
+#endif
+#if RX_GAP_CYCLES > 255
+#error F_CPU too high for GCN64_TIMER_RX
+#endif
+
+/* \brief Receive a reply, sampling each bit 2uS after its falling edge.
+ * \param expected_bits The reply length, or 0 if unknown.
+ * \return The number of bits received (stop bit excluded), 0 on timeout/error.
+ *
+ * The result is in gcn64_workbuf, packed, MSb first.
+ *
+ * Alternative to the receiver above. Instead of counting loop iterations,
+ * each falling edge is timestamped from Timer1, which runs free at the CPU
+ * clock (see hardwareInit() in main.c).
+ * Only the time between falling edges is checked. If it is above ~10uS,
+ * something (the USB interrupt) stalled reception in the middle of the
+ * reply and edges were lost. The reply is dropped and counted as a collision
+ * instead of being misdecoded.
+ *
+ * The bit value is the line level 2uS after the falling edge:
+ *
+ * 0 : 3 us low, 1 us high  -> low
+ * 1 : 1 us low, 3 us high  -> high
+ * HORI pads: 4.5/1.5 and 1.5/4.5 us, sampled at the same place.
+ *
+ * Timestamping and the gap check are done while waiting for the sample
+ * point, so the per-bit cost is the same as the other receiver.
+ *
+ * A sample is only stored when the next falling edge arrives in time.
+ * The stop bit also starts with a falling edge, and the line is high
+ * 2uS later: its sample is taken but never stored, so the bit count is
+ * the same as the other receiver's, whether the length is known or not.
+ * Likewise nothing is stored for an edge which comes after a gap.
+ *
+ * Like the other receiver, this is a busy loop with interrupts enabled.
+ * An interrupted reply is detected and dropped, not recovered.
+ *
+ * Note: Servicing each edge from a pin change interrupt (PCINT on the
+ * ATmega168) is not possible: at 12MHz a 1uS level lasts 12 cycles,
+ * less than entering and leaving an interrupt handler. V-USB also does
+ * not tolerate its interrupt being delayed by more than 25 cycles.
+ */
+static inline __attribute__((always_inline))
+unsigned int gcn64_receivePin(int expected_bits, unsigned char bit)
+{
+	unsigned char left = gcn64_bytesToReceive(expected_bits);
+	unsigned char cur, gap;
+	unsigned char volatile *ptr = gcn64_workbuf[gcn64_port];
+
+#define RX_WAIT_HIGH(timeout_label)	"	ldi r16, %5				\n" \
+									"1:	inc r16					\n" \
+									"	brmi " timeout_label "	\n" \
+									"	sbis %4, %10				\n" \
+									"	rjmp 1b					\n"
+
+#define RX_WAIT_LOW(timeout_label)	"	ldi r16, %5				\n" \
+									"1:	inc r16					\n" \
+									"	brmi " timeout_label "	\n" \
+									"	sbic %4, %10				\n" \
+									"	rjmp 1b					\n"
+
+	asm volatile(
+		"	clr %1					\n"
+		"	ser r19					\n" // pending 1: becomes the sentinel
+		"	clr %3					\n"
+		"	clr r16					\n"
+"rx_initial_wait_low%=:\n"
+		"	inc r16					\n"
+		"	breq rx_timeout%=		\n" // overflow to 0
+		"	sbic %4, %10				\n"
+		"	rjmp rx_initial_wait_low%=	\n"
+
+		// first falling edge. Nothing to compare with. Same
+		// duration as the normal path (rjmp + 12 cycles).
+		"	lds r22, %6				\n"
+		"	lds r23, %7				\n"
+		"	nop\n nop\n nop\n nop\n nop\n nop\n nop\n nop\n"
+		"	rjmp rx_sample%=		\n"
+
+"rx_fall%=:\n"
+		"	lds r20, %6				\n" // TCNT1L, latches TCNT1H
+		"	lds r21, %7				\n"
+		"	movw r24, r20			\n"
+		"	sub r24, r22			\n"
+		"	sbc r25, r23			\n" // r25:r24 : cycles since last falling edge
+		"	movw r22, r20			\n"
+		"	tst r25					\n"
+		"	brne rx_gap%=			\n"
+		"	cpi r24, %9				\n"
+		"	brsh rx_gap%=			\n"
+
+"rx_sample%=:\n"
+		"	.rept %8				\n"
+		"	nop						\n"
+		"	.endr					\n"
+		"	in r18, %4				\n" // sample
+		// An edge followed: store the previous sample
+		"	sec						\n"
+		"	sbrs r19, %10			\n"
+		"	clc						\n"
+		"	mov r19, r18			\n"
+		"	rol %1					\n"
+		"	brcc rx_next%=			\n" // sentinel not out yet
+		"	st z+, %1				\n"
+		"	ldi %1, 0x01			\n"
+		"	dec %0					\n"
+		"	breq rx_last%=			\n" // got everything
+
+"rx_next%=:\n"
+		// end of the low level of a 0
+		RX_WAIT_HIGH("rx_error%=")
+		// beginning of the next bit. Timing out here is the stop bit.
+		RX_WAIT_LOW("rx_done%=")
+		"	rjmp rx_fall%=			\n"
+
+		// The last byte is in, stored at the falling edge of the stop
+		// bit. Wait for its end instead of waiting for a timeout.
+"rx_last%=:\n"
+		RX_WAIT_HIGH("rx_error%=")
+		"	rjmp rx_done%=			\n"
+
+"rx_timeout%=:\n"
+		"	clr %0					\n" // RX_NO_REPLY
+		"	dec %0					\n"
+		"	rjmp rx_error%=			\n"
+"rx_gap%=:\n"
+		"	inc %3					\n"
+"rx_error%=:\n"
+		"	clr %1					\n"
+"rx_done%=:\n"
+		: 	"+r" (left),						// %0
+			"=&d" (cur),						// %1
+			"+z" (ptr),							// %2
+			"=&r" (gap)							// %3
+		: 	"I" (_SFR_IO_ADDR(GCN64_DATA_PIN)),	// %4
+			"M" (TIMING_OFFSET),				// %5
+			"n" (_SFR_MEM_ADDR(TCNT1L)),		// %6
+			"n" (_SFR_MEM_ADDR(TCNT1H)),		// %7
+			"M" (RX_SAMPLE_NOPS),				// %8
+			"M" (RX_GAP_CYCLES),				// %9
+			"I" (bit)							// %10
+		: 	"r16", "r18", "r19", "r20", "r21", "r22", "r23", "r24", "r25"
+	);
+
+	if (gap)
+		gcn64_rx_collisions++;
+
+	return gcn64_receiveEnd(ptr, left, cur);
+}
+#endif // GCN64_TIMER_RX
+
+static unsigned int gcn64_receive(int expected_bits)
+{
+	switch (gcn64_port)
+	{
+#if GCN64_NUM_PORTS > 3
+		case 3: return gcn64_receivePin(expected_bits, GCN64_DATA_BITNUM(3));
+#endif
+#if GCN64_NUM_PORTS > 2
+		case 2: return gcn64_receivePin(expected_bits, GCN64_DATA_BITNUM(2));
+#endif
+#if GCN64_NUM_PORTS > 1
+		case 1: return gcn64_receivePin(expected_bits, GCN64_DATA_BITNUM(1));
+#endif
+		default: return gcn64_receivePin(expected_bits, GCN64_DATA_BITNUM(0));
+	}
+}
+
+static void gcn64_sendBytes(unsigned char *data, unsigned char n_bytes);
+
+/* \brief Record the low and high level lengths of each bit of a reply.
+ * \param dst Receives one low/high count pair per bit
+ * \param bits The number of bits to record (stop bit excluded)
+ * \return The number of bits seen. bits if all bits and the stop bit
+ *         were seen, 0 if there was no reply.
+ *
+ * Counts are in receive loop iterations (5 cycles), TIMING_OFFSET
+ * included, measured like gcn64_receive() does.
+ */
+static inline __attribute__((always_inline))
+unsigned char gcn64_receiveTimingsPin(unsigned char *dst, unsigned char bits, unsigned char bit)
+{
+	unsigned char total = bits;
+
+	asm volatile(
+		"	clr r16					\n"
+"rt_initial_wait_low%=:\n"
+		"	inc r16					\n"
+		"	breq rt_done%=			\n" // overflow to 0
+		"	sbic %2, %4				\n"
+		"	rjmp rt_initial_wait_low%=	\n"
+
+"rt_bit%=:\n"
+		"	ldi r16, %3				\n"
+"1:	inc r16					\n"
+		"	brmi rt_done%=			\n"
+		"	sbis %2, %4				\n"
+		"	rjmp 1b					\n"
+		"	st z+, r16				\n"
+
+		"	ldi r16, %3				\n"
+"1:	inc r16					\n"
+		"	brmi rt_done%=			\n" // stop bit too early
+		"	sbic %2, %4				\n"
+		"	rjmp 1b					\n"
+		"	st z+, r16				\n"
+		"	dec %0					\n"
+		"	brne rt_bit%=			\n"
+
+		// The last falling edge was the stop bit. Wait for its end.
+		"	ldi r16, %3				\n"
+"1:	inc r16					\n"
+		"	brmi rt_error%=			\n"
+		"	sbis %2, %4				\n"
+		"	rjmp 1b					\n"
+		"	rjmp rt_done%=			\n"
+"rt_error%=:\n"
+		"	inc %0					\n"
+"rt_done%=:\n"
+		:	"+r" (bits),						// %0
+			"+z" (dst)							// %1
+		:	"I" (_SFR_IO_ADDR(GCN64_DATA_PIN)),	// %2
+			"M" (TIMING_OFFSET),				// %3
+			"I" (bit)							// %4
+		:	"r16"
+	);
+
+	return total - bits;
+}
+
+static unsigned char gcn64_receiveTimings(unsigned char *dst, unsigned char bits)
+{
+	switch (gcn64_port)
+	{
+#if GCN64_NUM_PORTS > 3
+		case 3: return gcn64_receiveTimingsPin(dst, bits, GCN64_DATA_BITNUM(3));
+#endif
+#if GCN64_NUM_PORTS > 2
+		case 2: return gcn64_receiveTimingsPin(dst, bits, GCN64_DATA_BITNUM(2));
+#endif
+#if GCN64_NUM_PORTS > 1
+		case 1: return gcn64_receiveTimingsPin(dst, bits, GCN64_DATA_BITNUM(1));
+#endif
+		default: return gcn64_receiveTimingsPin(dst, bits, GCN64_DATA_BITNUM(0));
+	}
+}
+
+/* \brief Learn the bit timings of the controller from its ID reply.
+ * \param t The low/high counts of the reply (see gcn64_receiveTimings)
+ *
+ * Each bit is classified using the current threshold, then the threshold
+ * is moved halfway between the average 0 and the average 1 (in terms of
+ * low minus high). Done twice, so a misclassification caused by a far off
+ * initial threshold is corrected.
+ *
+ * Nothing is changed if the reply is incomplete or contains only 1s or
+ * only 0s.
+ */
+static void gcn64_calibrate(const unsigned char *t)
+{
+	unsigned int sum_low[2], sum_high[2];
+	unsigned char n[2];
+	struct gcn64_timing_profile *prof = &gcn64_profile[gcn64_port];
+	signed char bias = prof->bias;
+	unsigned char i, pass;
+	int d0, d1;
+
+	for (pass=0; pass<2; pass++) {
+		sum_low[0] = sum_low[1] = 0;
+		sum_high[0] = sum_high[1] = 0;
+		n[0] = n[1] = 0;
+
+		for (i=0; i<GC_GETID_REPLY_LENGTH; i++) {
+			unsigned char low = t[i*2] - TIMING_OFFSET;
+			unsigned char high = t[i*2+1] - TIMING_OFFSET;
+			unsigned char b = (low - high) < bias;
+
+			sum_low[b] += low;
+			sum_high[b] += high;
+			n[b]++;
+		}
+
+		if (!n[0] || !n[1])
+			return;
+
+		d0 = (int)(sum_low[0] - sum_high[0]) / n[0];
+		d1 = (int)(sum_low[1] - sum_high[1]) / n[1];
+		bias = (d0 + d1) / 2;
+		if (bias > GCN64_MAX_BIAS)
+			bias = GCN64_MAX_BIAS;
+		if (bias < -GCN64_MAX_BIAS)
+			bias = -GCN64_MAX_BIAS;
+	}
+
+	prof->low1 = sum_low[1] / n[1];
+	prof->high1 = sum_high[1] / n[1];
+	prof->low0 = sum_low[0] / n[0];
+	prof->high0 = sum_high[0] / n[0];
+	prof->bias = bias;
+	prof->ones = n[1];
+	prof->calibrations++;
+}
 
-	// Explode the data to one byte per bit for very easy transmission in assembly.
-	// This trades memory for ease of implementation.
-	bits = bitsToWorkbufBytes(data, n_bytes, 0);
-	if (!bits)
+/* \brief Decide the bits of recorded timings like gcn64_receive() does,
+ * with the current threshold, and store them packed in gcn64_workbuf.
+ * \param t The low/high counts (see gcn64_receiveTimings)
+ * \param bits The number of bits. A multiple of 8.
+ */
+static void gcn64_decodeTimings(const unsigned char *t, unsigned char bits)
+{
+	unsigned char volatile *dst = gcn64_workbuf[gcn64_port];
+	signed char bias = gcn64_profile[gcn64_port].bias;
+	unsigned char i, cur = 0;
+
+	for (i=0; i<bits; i++) {
+		cur <<= 1;
+		if ((t[i*2] - t[i*2+1]) < bias)
+			cur |= 1;
+		if ((i & 7) == 7) {
+			*dst++ = cur;
+		}
+	}
+}
+
+const struct gcn64_timing_profile *gcn64_getTimingProfile(unsigned char port)
+{
+	return &gcn64_profile[port];
+}
+
+/* \brief Send bytes and a stop bit, MSb first.
+ *
+ * Bits are shifted straight out of the caller's buffer. Every bit takes
+ * GCN64_T_SHORT + GCN64_T_LONG cycles (48, 4uS at 12MHz), low for
+ * GCN64_T_SHORT (1) or GCN64_T_LONG (0) cycles. Loading the next byte and
+ * counting bits (NEXT_BIT) always takes 8 cycles, and it is placed in the
+ * long part of each bit so it does not disturb the 1uS parts.
+ */
+static inline __attribute__((always_inline))
+void gcn64_sendBytesPin(unsigned char *data, unsigned char n_bytes, unsigned char bit)
+{
+	if (n_bytes == 0)
 		return;
 
 	// the value of the gpio is pre-configured to low. We simulate
 	// an open drain output by toggling the direction.
-#define PULL_DATA		"	sbi %0, 3               \n"
-#define RELEASE_DATA	"	cbi %0, 3               \n"
-
-	// busy looping delays based on busy loop and nop tuning.
-	// valid for 12Mhz clock.
-#define DLY_SHORT_1ST	"ldi r17, 1\n rcall sb_dly%=\n "
-#define DLY_LARGE_1ST	"ldi r17, 9\n rcall sb_dly%=\n"
-#define DLY_SHORT_2ND	"\n" 
-#define DLY_LARGE_2ND	"ldi r17, 5\n rcall sb_dly%=\n nop\nnop\n"
+#define PULL_DATA		"	sbi %2, %8              \n"
+#define RELEASE_DATA	"	cbi %2, %8              \n"
+
+	// Delay of 'cycles' (an asm operand) cycles. The assembler picks
+	// ldi + rcall sb_dly (3*r17 + 7 cycles) plus nops, or only nops for
+	// short delays. At 12MHz: 26, 3, 10 and 19 cycles.
+#define DLY(cycles)		".if " cycles " >= 10				\n" \
+						"	ldi r17, (" cycles " - 7) / 3	\n" \
+						"	rcall sb_dly%=					\n" \
+						"	.rept (" cycles " - 7) %% 3		\n" \
+						"	nop								\n" \
+						"	.endr							\n" \
+						".else								\n" \
+						"	.rept " cycles "				\n" \
+						"	nop								\n" \
+						"	.endr							\n" \
+						".endif								\n"
+#define DLY_LARGE_1ST	DLY("%4")
+#define DLY_SHORT_2ND	DLY("%5")
+#define DLY_SHORT_1ST	DLY("%6")
+#define DLY_LARGE_2ND	DLY("%7")
+
+	// 8 cycles, whether or not a new byte is loaded.
+#define NEXT_BIT		"	dec r18			\n" \
+						"	brne 1f			\n" \
+						"	ld r16, z+		\n" \
+						"	ldi r18, 8		\n" \
+						"	dec %0			\n" \
+						"	rjmp 2f			\n" \
+						"1:	nop				\n" \
+						"	nop				\n" \
+						"	nop				\n" \
+						"	nop				\n" \
+						"	nop				\n" \
+						"2:					\n"
 
 	asm volatile(
-	// Save the modified input operands
-	"	push r28			\n" // y
-	"	push r29			\n"
-	"	push r30			\n" // z
-	"	push r31			\n"
-
-	"sb_loop%=:				\n"
 	"	ld r16, z+			\n"
-	"	tst r16				\n"
-	"	breq sb_send0%=		\n"
-	"	brne sb_send1%=		\n"
-
-	"	rjmp sb_end%=		\n" // not reached
+	"	ldi r18, 8			\n"
 
+	"sb_loop%=:				\n" // 5 cycles to PULL_DATA
+	"	tst %0				\n"
+	"	breq sb_end%=		\n"
+	"	lsl r16				\n"
+	"	brcs sb_send1%=		\n"
 
 	"sb_send0%=:			\n"
 	"	nop					\n"
 	PULL_DATA
+	NEXT_BIT
 	DLY_LARGE_1ST
 	RELEASE_DATA
 	DLY_SHORT_2ND
-	"	sbiw	%1, 1		\n"
-	"	brne sb_loop%=		\n"
-	"	rjmp sb_end%=		\n"
+	"	rjmp sb_loop%=		\n"
 
 	"sb_send1%=:			\n"
 	PULL_DATA
 	DLY_SHORT_1ST
 	RELEASE_DATA
+	NEXT_BIT
 	DLY_LARGE_2ND
-	"	sbiw	%1, 1		\n"
-	"	brne sb_loop%=		\n"
-	"	rjmp sb_end%=		\n"
+	"	rjmp sb_loop%=		\n"
 
 // delay sub (arg r17)
 	"sb_dly%=:				\n"
 	"	dec r17				\n"
 	"	brne sb_dly%=		\n"
 	"	ret					\n"
-	
 
 	"sb_end%=:\n"
-	// going here is fast so we need to extend the last
-	// delay by 500nS
+	// going here is 2 cycles faster than going to the
+	// next bit.
+	"	nop\n "
 	"	nop\n "
-	"	pop r31				\n"
-	"	pop r30				\n"
-	"	pop r29				\n"
-	"	pop r28				\n"
 	PULL_DATA
 	DLY_SHORT_1ST
 	RELEASE_DATA
@@ -246,73 +780,60 @@ static void gcn64_sendBytes(unsigned char *data, unsigned char n_bytes)
 	"sb_waitHigh%=:			\n"
 	"	dec r16				\n" // decrement timeout
 	"	breq sb_wait_high_done%=		\n" // handle timeout condition
-	"	sbis %3, 3			\n" // Read the port
+	"	sbis %3, %8			\n" // Read the port
 	"	rjmp sb_waitHigh%=	\n"
 "sb_wait_high_done%=:\n"
-	:
-	: "I" (_SFR_IO_ADDR(GCN64_DATA_DDR)), // %0
-	  "w" (bits),						// %1
-	  "z" ((unsigned char volatile *)gcn64_workbuf),					// %2
-	  "I" (_SFR_IO_ADDR(GCN64_DATA_PIN))	// %3
-	: "r16", "r17");
+	: "+r" (n_bytes),					// %0
+	  "+z" (data)						// %1
+	: "I" (_SFR_IO_ADDR(GCN64_DATA_DDR)), // %2
+	  "I" (_SFR_IO_ADDR(GCN64_DATA_PIN)),	// %3
+	  "M" (GCN64_T_LONG - 10),			// %4 : sb_send0 low, after PULL_DATA and NEXT_BIT
+	  "M" (GCN64_T_SHORT - 9),			// %5 : sb_send0 high, after RELEASE_DATA, rjmp and sb_loop
+	  "M" (GCN64_T_SHORT - 2),			// %6 : sb_send1 and stop bit low, after PULL_DATA
+	  "M" (GCN64_T_LONG - 17),			// %7 : sb_send1 high, after RELEASE_DATA, NEXT_BIT, rjmp and sb_loop
+	  "I" (bit)							// %8
+	: "r16", "r17", "r18");
 }
 
-/* \brief Decode the received length of low/high states to byte-per-bit format
- *
- * The result is in workbuf.
- *
- **/
-static void gcn64_decodeWorkbuf(unsigned char count)
+static void gcn64_sendBytes(unsigned char *data, unsigned char n_bytes)
 {
-	unsigned char i;
-	volatile unsigned char *output = gcn64_workbuf;
-	volatile unsigned char *input = gcn64_workbuf;
-	unsigned char t;
-
-    //  
-    //          ________
-    // ________/
-    //  
-    //   [i*2]    [i*2+1]
-    //  
-    //          ________________
-    // 0 : ____/
-    //                      ____
-    // 1 : ________________/
-    //  
-    // The timings on a real N64 are
-    //  
-    // 0 : 1 us low, 3 us high
-    // 1 : 3 us low, 1 us high
-    //  
-    // However, HORI pads use something similar to
-    //  
-    // 0 : 1.5 us low, 4.5 us high
-    // 1 : 4.5 us low, 1.5 us high
-    //  
-    //  
-    // No64 us = microseconds
-
-	// This operation takes approximately 100uS on 64bit gamecube messages
-	for (i=0; i<count; i++) {
-		t = *input; 
-		input++;
-
-		*output = t < *input;
-
-		input++;
-		output++;
+	switch (gcn64_port)
+	{
+#if GCN64_NUM_PORTS > 3
+		case 3: gcn64_sendBytesPin(data, n_bytes, GCN64_DATA_BITNUM(3)); break;
+#endif
+#if GCN64_NUM_PORTS > 2
+		case 2: gcn64_sendBytesPin(data, n_bytes, GCN64_DATA_BITNUM(2)); break;
+#endif
+#if GCN64_NUM_PORTS > 1
+		case 1: gcn64_sendBytesPin(data, n_bytes, GCN64_DATA_BITNUM(1)); break;
+#endif
+		default: gcn64_sendBytesPin(data, n_bytes, GCN64_DATA_BITNUM(0)); break;
 	}
 }
 
+#if GCN64_NUM_PORTS > 1
+/* Select the port used by all the functions in this file, for the
+ * controller and for the per-port state (calibration, housekeeping). */
+void gcn64_selectPort(unsigned char port)
+{
+	gcn64_port = port;
+}
+
+unsigned char gcn64_getPort(void)
+{
+	return gcn64_port;
+}
+#endif
+
 void gcn64protocol_hwinit(void)
 {
 	// data as input
-	GCN64_DATA_DDR &= ~(GCN64_DATA_BIT);
+	GCN64_DATA_DDR &= ~(GCN64_DATA_MASK);
 
 	// keep data low. By toggling the direction, we make the
 	// pin act as an open-drain output.
-	GCN64_DATA_PORT &= ~GCN64_DATA_BIT;
+	GCN64_DATA_PORT &= ~GCN64_DATA_MASK;
 	
 	/* debug bit PORTB4 (MISO) */
 	DDRB |= 0x10;
@@ -323,59 +844,460 @@ void gcn64protocol_hwinit(void)
 
 /**
  * \brief Send n data bytes + stop bit, wait for answer.
+ * \param data_out The bytes to send
+ * \param data_out_len The number of bytes to send
+ * \param expected_bits The expected reply length. Allows returning as soon
+ *                      as the reply is complete. 0 to wait for a timeout.
  * \return The number of bits received, 0 on timeout/error.
  *
- * The result is in gcn64_workbuf, where each byte represents
- * a bit.
+ * The result is in gcn64_workbuf, packed. Use gcn64_protocol_getByte()
+ * to access it.
  */
-int gcn64_transaction(unsigned char *data_out, int data_out_len)
+int gcn64_transaction(unsigned char *data_out, int data_out_len, int expected_bits)
 {
 	int count;
+	unsigned int t;
+
+	gcn64_stats.transactions++;
 
 	gcn64_sendBytes(data_out, data_out_len);
-	count = gcn64_receive();
-	if (!count)
+	t = TCNT1;
+	count = gcn64_receive(expected_bits);
+	t = TCNT1 - t;
+	if (!count) {
+		gcn64_housekeepingNow();
 		return 0;
+	}
 
-	if (!(count & 0x01)) {
-		// If we don't get an odd number of level lengths from gcn64_receive
-		// something is wrong. 
-		//
-		// The stop bit is a short (~1us) low state followed by an "infinite"
-		// high state, which timeouts and lets the function return. This
-		// is why we should receive and odd number of lengths.
-		return 0;
+	if (expected_bits && count != expected_bits) {
+		gcn64_stats.short_replies++;
+		gcn64_housekeepingNow();
+	} else if (count == expected_bits) {
+		// The receivers return right after the stop bit when the length
+		// is known. Timer1 runs at the CPU clock (see hardwareInit()).
+		t /= count + 1;
+		if (t > gcn64_stats.max_bit_time)
+			gcn64_stats.max_bit_time = t;
 	}
 
-	gcn64_decodeWorkbuf(count);
-	
 	/* this delay is required on N64 controllers. Otherwise, after sending
 	 * a rumble-on or rumble-off command (probably init too), the following
 	 * get status fails. This starts to work at 2us. 5 should be safe. */
 	_delay_us(5);
 	
-	/* return the number of full bits received. */
-	return (count-1) / 2;
+	return count;
+}
+
+
+/**
+ * \brief gcn64_transaction() for polls, retried on failure if there is time.
+ * \param data_out The bytes to send
+ * \param data_out_len The number of bytes to send
+ * \param expected_bits The expected reply length. Must be known.
+ * \return The number of bits received. Something else than expected_bits
+ *         on failure.
+ *
+ * A single glitch on the line would otherwise make the caller wait for
+ * the next poll (~4ms). The command is re-issued immediately, up to
+ * GCN64_RETRIES times, as long as a complete transaction still fits
+ * before the next expected USB interrupt (see sched.c). Only use this for
+ * commands which can be repeated without side effects.
+ */
+int gcn64_transactionRetry(unsigned char *data_out, int data_out_len, int expected_bits)
+{
+	// Command, reply and stop bits are 4uS. The rest is turnaround and
+	// the delay at the end of gcn64_transaction().
+	unsigned long duration = (data_out_len * 8L + expected_bits + 2) * GCN64_CYCLES(4000) +
+								GCN64_CYCLES(20000);
+	unsigned char retries = 0;
+	int count;
+
+	while (1) {
+		count = gcn64_transaction(data_out, data_out_len, expected_bits);
+		if (count == expected_bits) {
+			if (retries) {
+				gcn64_stats.retried++;
+			} else {
+				gcn64_stats.first_try++;
+			}
+			return count;
+		}
+
+		if (retries >= GCN64_RETRIES || sched_timeLeft() < duration)
+			break;
+
+		retries++;
+		_delay_us(5);
+	}
+
+	gcn64_stats.failed++;
+	return count;
+}
+
+#if GCN64_NUM_PORTS > 1 && defined(GCN64_PARALLEL_POLL)
+/* Cycles between two samples of the parallel receiver, ~0.67uS (8 at 12MHz) */
+#define PAR_SAMPLE_CYCLES		GCN64_CYCLES(667)
+
+/* Samples from a falling edge to the bit decision, ~2uS */
+#define PAR_SAMPLE_OFFSET		(GCN64_CYCLES(2000) / PAR_SAMPLE_CYCLES)
+
+/* Sampling loop iterations (2 samples each) to capture a reply and its
+ * stop bit, allowing ~20uS for the controllers to start answering. */
+#define PAR_ITERATIONS(bits, bit_ns)	((((bits) + 1) * GCN64_CYCLES(bit_ns) + GCN64_CYCLES(20000)) / \
+											(2 * PAR_SAMPLE_CYCLES))
+
+#if PAR_SAMPLE_CYCLES < 7
+#error F_CPU too low for GCN64_PARALLEL_POLL
+#endif
+#if PAR_ITERATIONS(GCN64_PAR_MAX_REPLY, 4000) > 255
+#error F_CPU too high for GCN64_PARALLEL_POLL
+#endif
+
+/* Two samples of PINC (data lines on PC3..PC0) per byte, the first one
+ * in the low nibble. The first byte is a dummy. 211 bytes at 12MHz. */
+#define PAR_MAX_ITERATIONS		PAR_ITERATIONS(GCN64_PAR_MAX_REPLY, 4000)
+static unsigned char gcn64_parbuf[1 + PAR_MAX_ITERATIONS];
+
+/* \brief Send bits on several data lines at once, and a stop bit.
+ * \param levels The DDR value for the middle part of each bit
+ * \param n_bits The number of bits
+ * \param pull The DDR value with all the lines low
+ * \param release The DDR value with all the lines released
+ * \param mask The lines in use
+ *
+ * Every bit starts with all the lines low. After GCN64_T_SHORT cycles, the
+ * DDR value for the bit releases the lines sending a 1, and after
+ * GCN64_T_LONG cycles all the lines are released. Each line can therefore
+ * send something different, as long as all the commands have the same
+ * length. Timing is the same as gcn64_sendBytesPin().
+ */
+static inline __attribute__((always_inline))
+void gcn64_sendParallel(unsigned char *levels, unsigned char n_bits,
+						unsigned char pull, unsigned char release, unsigned char mask)
+{
+	asm volatile(
+	"sp_loop%=:				\n"
+	"	out %2, %3			\n" // all lines low
+	"	ld r16, z+			\n"
+	DLY("%6")
+	"	out %2, r16			\n" // release the lines sending a 1
+	DLY("%7")
+	"	out %2, %4			\n" // release all the lines
+	DLY("%8")
+	"	dec %0				\n"
+	"	brne sp_loop%=		\n"
+	"	nop					\n" // brne not taken is 1 cycle shorter
+	"	out %2, %3			\n" // stop bit
+	DLY("%9")
+	"	out %2, %4			\n"
+
+	// wait until all the lines are high, so the receiver
+	// does not take the stop bit for the first reply bit.
+	"	ldi r16, 0xff		\n"
+	"sp_waitHigh%=:			\n"
+	"	dec r16				\n"
+	"	breq sp_done%=		\n"
+	"	in r17, %10			\n"
+	"	and r17, %5			\n"
+	"	cp r17, %5			\n"
+	"	brne sp_waitHigh%=	\n"
+	"	rjmp sp_done%=		\n"
+
+	// delay sub (arg r17), for DLY()
+	"sb_dly%=:				\n"
+	"	dec r17				\n"
+	"	brne sb_dly%=		\n"
+	"	ret					\n"
+	"sp_done%=:				\n"
+	: "+r" (n_bits),						// %0
+	  "+z" (levels)							// %1
+	: "I" (_SFR_IO_ADDR(GCN64_DATA_DDR)),	// %2
+	  "r" (pull),							// %3
+	  "r" (release),						// %4
+	  "r" (mask),							// %5
+	  "M" (GCN64_T_SHORT - 3),				// %6 : low, after out and ld
+	  "M" (GCN64_T_LONG - GCN64_T_SHORT - 1),	// %7 : middle, after out
+	  "M" (GCN64_T_SHORT - 4),				// %8 : high, after out, dec and brne
+	  "M" (GCN64_T_SHORT - 1),				// %9 : stop bit low, after out
+	  "I" (_SFR_IO_ADDR(GCN64_DATA_PIN))	// %10
+	: "r16", "r17");
+}
+
+/* \brief Sample all the data lines, 2 samples per iteration.
+ *
+ * Samples are PAR_SAMPLE_CYCLES apart. Each one is stored in a nibble, so
+ * a 64 bit reply needs ~200 bytes instead of ~400.
+ */
+static inline __attribute__((always_inline))
+void gcn64_sampleParallel(unsigned char *dst, unsigned char iterations)
+{
+	asm volatile(
+	"	clr r17				\n" // the dummy first byte
+	"ps_loop%=:				\n"
+	"	in r16, %2			\n" // 1st sample
+	"	st z+, r17			\n" // previous pair
+	"	andi r16, 0x0f		\n"
+	"	.rept %3			\n"
+	"	nop					\n"
+	"	.endr				\n"
+	"	in r17, %2			\n" // 2nd sample
+	"	swap r17			\n"
+	"	andi r17, 0xf0		\n"
+	"	or r17, r16			\n"
+	"	.rept %4			\n"
+	"	nop					\n"
+	"	.endr				\n"
+	"	dec %0				\n"
+	"	brne ps_loop%=		\n"
+	"	st z+, r17			\n"
+	: "+r" (iterations),					// %0
+	  "+z" (dst)							// %1
+	: "I" (_SFR_IO_ADDR(GCN64_DATA_PIN)),	// %2
+	  "M" (PAR_SAMPLE_CYCLES - 4),			// %3 : after in, st, andi
+	  "M" (PAR_SAMPLE_CYCLES - 7)			// %4 : after in, swap, andi, or, dec, brne
+	: "r16", "r17");
+}
+
+#if PAR_SAMPLE_OFFSET < 1 || PAR_SAMPLE_OFFSET > 8
+#error F_CPU out of range for the parallel decoder
+#endif
+
+/* \brief Decode the replies of several ports from gcn64_parbuf.
+ * \param ports Bitmask of the ports to decode (1 << port)
+ * \param bits Receives the number of bits decoded for each port, at most
+ *             expected_bits.
+ *
+ * Like GCN64_TIMER_RX, each bit is the line level PAR_SAMPLE_OFFSET samples
+ * (~2uS) after its falling edge. With one sample every ~0.67uS, the bit is
+ * sampled between ~1.3 and ~2.7uS after the edge, after the low level of a 1
+ * (1uS, 1.5uS on HORI pads) and before the end of the low level of a 0 (3uS).
+ *
+ * All the lines are decoded in a single pass over the samples. The falling
+ * edges of all the lines are found at once, with a few logic operations on
+ * the sample nibble, and kept for PAR_SAMPLE_OFFSET samples in hist[]. A
+ * line is only handled on its own at the sample where one of its bits is
+ * decided. Edges on a line waiting for its decision are ignored.
+ *
+ * Hand estimated at 12MHz: ~20 cycles per sample for all the lines, and
+ * ~25 per decoded bit. For four GC status replies (~420 samples, 256
+ * bits), ~15000 cycles or ~1.3ms, against ~4ms with one pass per line.
+ * None of this is timing sensitive: the samples are already taken.
+ */
+static void gcn64_demuxParallel(unsigned char ports, unsigned char iterations,
+								unsigned char expected_bits, unsigned char *bits)
+{
+	unsigned char hist[PAR_SAMPLE_OFFSET];
+	unsigned char cur[GCN64_NUM_PORTS];
+	unsigned char volatile *dst[GCN64_NUM_PORTS];
+	unsigned char *src = gcn64_parbuf + 1;
+	unsigned char active = 0, pending = 0, prev;
+	unsigned char samples, level, edges, decide, lane, full;
+	unsigned char h, i = 0, p;
+
+	for (p=0; p<GCN64_NUM_PORTS; p++) {
+		cur[p] = 0x01; // sentinel
+		bits[p] = 0;
+		dst[p] = gcn64_workbuf[p];
+		if (ports & (1<<p))
+			active |= 1 << GCN64_DATA_BITNUM(p);
+	}
+	for (h=0; h<PAR_SAMPLE_OFFSET; h++)
+		hist[h] = 0;
+	prev = active; // lines high
+
+	while (iterations-- && active) {
+		samples = *src++;
+		for (h=0; h<2; h++) {
+			level = samples & 0x0f;
+			samples >>= 4;
+
+			// Falling edges PAR_SAMPLE_OFFSET samples ago
+			decide = hist[i];
+			edges = prev & ~level & active & ~pending;
+			pending = (pending & ~decide) | edges;
+			hist[i] = edges;
+			if (++i == PAR_SAMPLE_OFFSET)
+				i = 0;
+			prev = level;
+
+			decide &= active;
+			if (!decide)
+				continue;
+
+			for (p=0; p<GCN64_NUM_PORTS; p++) {
+				lane = 1 << GCN64_DATA_BITNUM(p);
+				if (!(decide & lane))
+					continue;
+
+				full = cur[p] & 0x80;
+				cur[p] = (cur[p] << 1) | ((level & lane) ? 1 : 0);
+				if (full) {
+					*dst[p]++ = cur[p];
+					cur[p] = 0x01;
+				}
+				if (++bits[p] == expected_bits)
+					active &= ~lane;
+			}
+		}
+	}
+}
+
+/**
+ * \brief gcn64_transaction() on several ports at once.
+ * \param ports Bitmask of the ports to use (1 << port)
+ * \param cmds The command for each port. Only the ports in 'ports' are used.
+ * \param cmd_len The length of the commands, up to GCN64_PAR_MAX_CMD bytes
+ * \param expected_bits The reply length. A multiple of 8, up to
+ *                      GCN64_PAR_MAX_REPLY.
+ * \return Bitmask of the ports which gave a complete reply.
+ *
+ * Reading one gamecube pad takes ~300uS of bus time, mostly waiting for
+ * the bits of the reply. Instead of reading the pads one after the other,
+ * the commands are sent on all the lines at once and all the lines are
+ * sampled while the controllers answer. The replies are then decoded from
+ * the samples (~1.3ms of CPU time for four GC pads at 12MHz, see
+ * gcn64_demuxParallel), so reading four pads takes the bus time of one.
+ *
+ * The controllers do not need to answer in sync. Each line is decoded
+ * from its own falling edges.
+ *
+ * Replies are read with gcn64_protocol_getByte() after selecting the port.
+ * There is no retry. A port which fails is simply read again at the next
+ * poll.
+ */
+unsigned char gcn64_transactionParallel(unsigned char ports, unsigned char cmds[][GCN64_PAR_MAX_CMD],
+										unsigned char cmd_len, int expected_bits)
+{
+	unsigned char levels[GCN64_PAR_MAX_CMD * 8];
+	unsigned char mask = 0, release, pull;
+	unsigned int iterations = PAR_ITERATIONS(expected_bits, 6000); // HORI pads
+	unsigned char ok = 0;
+	unsigned char p, i;
+	unsigned char bits[GCN64_NUM_PORTS];
+
+	if (!cmd_len || cmd_len > GCN64_PAR_MAX_CMD || (expected_bits & 7) ||
+			expected_bits > GCN64_PAR_MAX_REPLY)
+		return 0;
+
+	for (p=0; p<GCN64_NUM_PORTS; p++) {
+		if (ports & (1<<p))
+			mask |= 1 << GCN64_DATA_BITNUM(p);
+	}
+	if (!mask)
+		return 0;
+
+	// Up to the buffer size. Enough for HORI pads on N64 status polls,
+	// and for normal pads on GC status polls.
+	if (iterations > PAR_MAX_ITERATIONS)
+		iterations = PAR_MAX_ITERATIONS;
+
+	release = GCN64_DATA_DDR & ~mask;
+	pull = release | mask;
+
+	// The lines sending a 0 stay low in the middle of the bit.
+	for (i=0; i<cmd_len * 8; i++) {
+		levels[i] = release;
+		for (p=0; p<GCN64_NUM_PORTS; p++) {
+			if ((ports & (1<<p)) && !(cmds[p][i / 8] & (0x80 >> (i & 7))))
+				levels[i] |= 1 << GCN64_DATA_BITNUM(p);
+		}
+	}
+
+	gcn64_sendParallel(levels, cmd_len * 8, pull, release, mask);
+	gcn64_sampleParallel(gcn64_parbuf, iterations);
+	gcn64_demuxParallel(ports, iterations, expected_bits, bits);
+
+	for (p=0; p<GCN64_NUM_PORTS; p++) {
+		if (!(ports & (1<<p)))
+			continue;
+
+		gcn64_stats.transactions++;
+		if (bits[p] == expected_bits) {
+			ok |= 1<<p;
+			continue;
+		}
+
+		if (bits[p]) {
+			gcn64_stats.short_replies++;
+		} else {
+			gcn64_stats.timeouts++;
+		}
+		gcn64_housekeeping_countdown[p] = 0;
+	}
+
+	// see gcn64_transaction()
+	_delay_us(5);
+
+	return ok;
 }
+#endif // GCN64_PARALLEL_POLL
 
+/**
+ * \brief Tell if the ID / capabilities command must be sent with this poll.
+ * \return Non-zero when due. Call once per poll.
+ *
+ * These commands used to be sent before each status poll, but their reply
+ * rarely changes. They are now sent every GCN64_HOUSEKEEPING_INTERVAL
+ * polls, and at the next poll after gcn64_housekeepingNow() is called.
+ * This happens when a controller is initialized and when a transaction
+ * fails.
+ */
+char gcn64_housekeepingDue(void)
+{
+	if (gcn64_housekeeping_countdown[gcn64_port]) {
+		gcn64_housekeeping_countdown[gcn64_port]--;
+		return 0;
+	}
+
+	gcn64_housekeeping_countdown[gcn64_port] = GCN64_HOUSEKEEPING_INTERVAL - 1;
+	return 1;
+}
+
+void gcn64_housekeepingNow(void)
+{
+	gcn64_housekeeping_countdown[gcn64_port] = 0;
+}
+
+const struct gcn64_stats *gcn64_getStats(void)
+{
+	return &gcn64_stats;
+}
 
 #if (GC_GETID != 	N64_GET_CAPABILITIES)
 #error N64 vs GC detection commnad broken
 #endif
+/* A single ID command. The level lengths of the reply are recorded, so
+ * the bit timings are learned (gcn64_calibrate) from the same reply,
+ * which is then decoded with them. */
 int gcn64_detectController(void)
 {
 	unsigned char tmp = GC_GETID;
-	int count;
+	unsigned char t[GC_GETID_REPLY_LENGTH * 2];
+	unsigned char count;
 	unsigned short id;
 
-	count = gcn64_transaction(&tmp, 1);
+	gcn64_stats.transactions++;
+
+	gcn64_sendBytes(&tmp, 1);
+	count = gcn64_receiveTimings(t, GC_GETID_REPLY_LENGTH);
+	_delay_us(5);
+
 	if (count == 0) {
+		gcn64_stats.timeouts++;
+		gcn64_housekeepingNow();
+		// The next controller may be a different one.
+		gcn64_profile[gcn64_port].bias = 0;
 		return CONTROLLER_IS_ABSENT;
 	}
-	if (count != 24) {
+	if (count != GC_GETID_REPLY_LENGTH) {
+		gcn64_stats.short_replies++;
+		gcn64_housekeepingNow();
 		return CONTROLLER_IS_UNKNOWN;
 	}
 
+	gcn64_calibrate(t);
+	gcn64_decodeTimings(t, GC_GETID_REPLY_LENGTH);
+
 	/* 
 	 * -- Standard gamecube controller answer:
 	 * 0000 1001 0000 0000 0010 0011  : 0x090023  or
@@ -19,11 +19,13 @@
 #define N64_GET_STATUS				0x01
 #define N64_GET_STATUS_REPLY_LENGTH	32
 
-/* Read from the expansion bus. */
+/* Read from the expansion bus. 32 bytes and a data CRC. */
 #define N64_EXPANSION_READ			0x02
+#define N64_EXPANSION_READ_REPLY_LENGTH	264
 
 /* Write to the expansion bus. */
 #define N64_EXPANSION_WRITE			0x03
+#define N64_EXPANSION_WRITE_REPLY_LENGTH	8
 
 /* Return information about controller. */
 #define GC_GETID					0x00
@@ -36,12 +38,29 @@
 #define GC_GETSTATUS3(rumbling)		((rumbling) ? 0x01 : 0x00)
 #define GC_GETSTATUS_REPLY_LENGTH	64
 
+/* Status reply bit 2: the controller wants its origin to be read again
+ * (e.g. after X+Y+Start was held). */
+#define GC_STATUS_ORIGIN_FLAG		0x20
+
+/* Get origin command. Returns the axis values the controller considers
+ * neutral (captured at power up or at the last recalibration), in the
+ * status reply format followed by two unused bytes. */
+#define GC_GETORIGIN				0x41
+#define GC_ORIGIN_REPLY_LENGTH		80
+
+/* 3-byte recalibrate command. The controller captures its origin now
+ * and returns it like GC_GETORIGIN. */
+#define GC_RECALIBRATE1				0x42
+#define GC_RECALIBRATE2				0x00
+#define GC_RECALIBRATE3				0x00
+
 /* 3-byte poll keyboard command.
  * Source: http://hitmen.c02.at/files/yagcd/yagcd/chap9.html#sec9.3.3
  * */
 #define GC_POLL_KB1					0x54
 #define GC_POLL_KB2					0x00
 #define GC_POLL_KB3					0x00
+#define GC_POLL_KB_REPLY_LENGTH		64
 
 /* Gamecube keycodes are from table 9.3.2:
  * http://hitmen.c02.at/files/yagcd/yagcd/chap9.html#sec9.3.2
@@ -158,11 +177,103 @@
 
 #define GC_KEY_ENTER			0x61
 
+/* Number of controller ports, 1 to 4. Build with -DGCN64_NUM_PORTS=4
+ * for a multi-port adapter. See gcn64_protocol.c for the pins. */
+#ifndef GCN64_NUM_PORTS
+#define GCN64_NUM_PORTS	1
+#endif
+
+/* With several ports, send the status poll to all the pads of the same
+ * type at once. See gcn64_transactionParallel(). Costs a 212 byte
+ * sample buffer and about 1.3ms of decoding after the wire time, so
+ * it is off by default. The Makefiles check the RAM budget. */
+#undef GCN64_PARALLEL_POLL
+
+/* Longest command and reply for gcn64_transactionParallel() (GC status) */
+#define GCN64_PAR_MAX_CMD		3
+#define GCN64_PAR_MAX_REPLY		GC_GETSTATUS_REPLY_LENGTH
+
+/* Receive replies using Timer1 timestamps, dropping those interrupted
+ * by the USB interrupt. See gcn64_protocol.c */
+#undef GCN64_TIMER_RX
+
+/* Bit timings learned from the controller ID reply at detection time.
+ * Lengths are averages in receive loop iterations (5 cycles). The
+ * bias is the threshold on low minus high used by the default receiver
+ * (GCN64_TIMER_RX samples at a fixed point and ignores it). */
+struct gcn64_timing_profile {
+	unsigned char low1, high1;	// 1 bits
+	unsigned char low0, high0;	// 0 bits
+	signed char bias;
+	unsigned char ones;			// 1 bits seen in the ID reply
+	unsigned char calibrations;	// successful calibrations since power up
+};
+
+/* Extra attempts gcn64_transactionRetry() may make after a failure */
+#define GCN64_RETRIES	2
+
+/* Polls between ID / capabilities commands. See gcn64_housekeepingDue() */
+#define GCN64_HOUSEKEEPING_INTERVAL	16
+
+/* Cumulative bus statistics since power up. Counters wrap. */
+struct gcn64_stats {
+	unsigned int transactions;
+	unsigned int timeouts;			// no reply at all
+	unsigned int framing_errors;	// reply stopped mid bit, or lost edges
+	unsigned int short_replies;		// wrong length
+	// gcn64_transactionRetry() outcomes
+	unsigned int first_try;			// succeeded at the first attempt
+	unsigned int retried;			// succeeded after one or more retries
+	unsigned int failed;			// retries or time exhausted
+	// Longest average bit time of a complete reply, in CPU cycles
+	// (nominally 4uS). Includes the controller's reply latency.
+	unsigned int max_bit_time;
+};
+
+/* Tables for gcn64_scatterReply(), in flash. For each reply byte, either
+ * one GCN64_SCATTER_BYTE entry (the byte, XORed, goes to dst[n]) or 8
+ * GCN64_SCATTER_BIT entries, MSb first (dst[n] |= mask when the bit is 1).
+ * Reply bits which are not used are GCN64_SCATTER_NONE. */
+#define GCN64_SCATTER_BYTE(n, xor)	(0x80 | (n)), (xor)
+#define GCN64_SCATTER_BIT(n, mask)	(n), (mask)
+#define GCN64_SCATTER_NONE			0, 0
+
 void gcn64protocol_hwinit(void);
 int gcn64_detectController(void);
-int gcn64_transaction(unsigned char *data_out, int data_out_len);
+int gcn64_transaction(unsigned char *data_out, int data_out_len, int expected_bits);
+int gcn64_transactionRetry(unsigned char *data_out, int data_out_len, int expected_bits);
+const struct gcn64_stats *gcn64_getStats(void);
+char gcn64_housekeepingDue(void);
+void gcn64_housekeepingNow(void);
 
 unsigned char gcn64_protocol_getByte(int offset);
 void gcn64_protocol_getBytes(int offset, int n_bytes, unsigned char *dstbuf);
+void gcn64_scatterReply(const unsigned char *table, unsigned char *dst, unsigned char n_bytes);
+const struct gcn64_timing_profile *gcn64_getTimingProfile(unsigned char port);
+
+#if GCN64_NUM_PORTS > 1
+void gcn64_selectPort(unsigned char port);
+unsigned char gcn64_getPort(void);
+#ifdef GCN64_PARALLEL_POLL
+unsigned char gcn64_transactionParallel(unsigned char ports, unsigned char cmds[][GCN64_PAR_MAX_CMD],
+										unsigned char cmd_len, int expected_bits);
+#endif
+#else
+#define gcn64_selectPort(port)	do { } while(0)
+#define gcn64_getPort()			0
+#endif
+
+#ifdef GCN64_TIMER_RX
+unsigned int gcn64_getCollisionCount(void);
+#endif
+
+/* 16 bit values in the bus statistics feature report (11h, see main.c):
+ * struct gcn64_stats, skipped afterPoll() tasks, USB collisions, and
+ * with GCN64_TIMER_RX the replies dropped by the receiver. */
+#ifdef GCN64_TIMER_RX
+#define GCN64_STATS_VALUES	11
+#else
+#define GCN64_STATS_VALUES	10
+#endif
 
 #endif // _gcn64_protocol_h__
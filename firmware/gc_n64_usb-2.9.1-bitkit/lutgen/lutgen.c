@@ -0,0 +1,148 @@
+/*	lutgen : Axis response curve tables for gc_n64_usb
+	Copyright (C) 2007-2014  Raphael Assenat <raph@raphnet.net>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* Reads a curve spec (see curves.txt) and writes the C source of one
+ * 256 entry PROGMEM table per curve on stdout.
+ *
+ * Each entry is the report value (0x80 +/- 127) for an axis byte:
+ *  - The deflection is the byte minus its center (input 'signed': two's
+ *    complement around 0, 'offset': around 0x80).
+ *  - Deflections up to 'deadzone' give 0x80.
+ *  - From there to 'reach', the output goes to 127, shaped by 'exponent'
+ *    (1 is linear, above 1 finer near the center).
+ *  - Beyond the reach, the output stays at full scale.
+ *
+ * Input 'unsigned' is for one-sided axes (triggers): the byte is the
+ * deflection from rest and the output goes from 0 to 255.
+ */
+
+struct curve {
+	char name[64];
+	char input[16];
+	int deadzone;
+	int reach;
+	double exponent;
+};
+
+static unsigned char lookup(const struct curve *c, int idx)
+{
+	int x, d;
+	double t;
+	long out;
+
+	if (!strcmp(c->input, "unsigned")) {
+		if (idx <= c->deadzone)
+			return 0;
+		t = (double)(idx - c->deadzone) / (c->reach - c->deadzone);
+		if (t > 1.0)
+			t = 1.0;
+		return lround(pow(t, c->exponent) * 255);
+	}
+
+	if (!strcmp(c->input, "signed"))
+		x = (signed char)idx;
+	else
+		x = idx - 0x80;
+
+	d = abs(x);
+	if (d <= c->deadzone)
+		return 0x80;
+
+	t = (double)(d - c->deadzone) / (c->reach - c->deadzone);
+	if (t > 1.0)
+		t = 1.0;
+	out = lround(pow(t, c->exponent) * 127);
+
+	return x < 0 ? 0x80 - out : 0x80 + out;
+}
+
+static int parseLine(const char *line, struct curve *c, int lineno)
+{
+	int n;
+
+	n = sscanf(line, "%63s %15s %d %d %lf", c->name, c->input,
+				&c->deadzone, &c->reach, &c->exponent);
+	if (n != 5)
+		goto bad;
+	if (strcmp(c->input, "signed") && strcmp(c->input, "offset") &&
+			strcmp(c->input, "unsigned"))
+		goto bad;
+	if (c->deadzone < 0 || c->reach <= c->deadzone ||
+			c->reach > (strcmp(c->input, "unsigned") ? 128 : 255))
+		goto bad;
+	if (c->exponent <= 0)
+		goto bad;
+
+	return 0;
+
+bad:
+	fprintf(stderr, "line %d: expected 'name signed|offset|unsigned deadzone reach exponent'"
+					" with 0 <= deadzone < reach <= 128 (255 if unsigned)"
+					" and exponent > 0\n", lineno);
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	FILE *fptr;
+	char line[256], *p;
+	struct curve c;
+	int lineno = 0, i;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: lutgen curves.txt > axis_lut.c\n");
+		return 1;
+	}
+
+	fptr = fopen(argv[1], "r");
+	if (!fptr) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	printf("/* Generated from %s by lutgen. Do not edit. */\n", argv[1]);
+	printf("#include \"axis_lut.h\"\n");
+
+	while (fgets(line, sizeof(line), fptr)) {
+		lineno++;
+
+		p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0)
+			continue;
+
+		if (parseLine(p, &c, lineno)) {
+			fclose(fptr);
+			return 1;
+		}
+
+		printf("\n// %s deadzone %d, reach %d, exponent %g\n",
+				c.input, c.deadzone, c.reach, c.exponent);
+		printf("const unsigned char %s_lut[256] PROGMEM = {", c.name);
+		for (i=0; i<256; i++) {
+			printf("%s0x%02x,", i % 16 ? " " : "\n\t", lookup(&c, i));
+		}
+		printf("\n};\n");
+	}
+
+	fclose(fptr);
+
+	return 0;
+}
@@ -0,0 +1,109 @@
+/*	gc_n64_usb : Gamecube or N64 controller to USB firmware
+	Copyright (C) 2007-2014  Raphael Assenat <raph@raphnet.net>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+
+#include "mailbox.h"
+#include "sched.h"
+
+/* Latest sample mailboxes, between the controller poller and the USB side.
+ *
+ * The poller used to send a report right after reading the controller,
+ * and only if the interrupt endpoint was free at that moment. Now it
+ * publishes each new report here, at its own rate. The USB side takes
+ * the freshest one as soon as the endpoint is free (see sendSamples() in
+ * main.c). Older samples which were not sent yet are simply replaced.
+ *
+ * Each mailbox has two buffers. A report is built in place in the one
+ * which is not the latest (mailbox_begin), and only becomes the latest
+ * when complete (mailbox_commit). A sample being built, or abandoned,
+ * never disturbs the latest one.
+ *
+ * Samples are timestamped when published. The age at send time tells
+ * how stale the data is when it is handed to the USB driver.
+ */
+
+struct mailbox {
+	unsigned char data[2][MAILBOX_SIZE];
+	unsigned char len[2];
+	unsigned long stamp[2];	// sched_now() when published
+	unsigned char latest;	// index of the freshest complete sample
+	unsigned char fresh;	// latest was not sent yet
+};
+
+static struct mailbox boxes[MAILBOX_COUNT];
+static struct mailbox_stats mailbox_stats;
+
+/* Where to build the next sample. At least MAILBOX_SIZE bytes. */
+unsigned char *mailbox_begin(unsigned char box)
+{
+	struct mailbox *mb = &boxes[box];
+
+	return mb->data[!mb->latest];
+}
+
+/* The sample started with mailbox_begin() is complete. */
+void mailbox_commit(unsigned char box, unsigned char len)
+{
+	struct mailbox *mb = &boxes[box];
+	unsigned char next = !mb->latest;
+
+	if (!len || len > MAILBOX_SIZE)
+		return;
+
+	mb->len[next] = len;
+	mb->stamp[next] = sched_now();
+
+	if (mb->fresh)
+		mailbox_stats.replaced++;
+	mailbox_stats.published++;
+
+	mb->latest = next;
+	mb->fresh = 1;
+}
+
+/* \brief Get the freshest sample, if it was not taken yet.
+ * \param dst Receives the sample (MAILBOX_SIZE bytes)
+ * \return The sample length. 0 if there is nothing new.
+ */
+unsigned char mailbox_take(unsigned char box, unsigned char *dst)
+{
+	struct mailbox *mb = &boxes[box];
+	unsigned char cur = mb->latest;
+	unsigned long age;
+
+	if (!mb->fresh)
+		return 0;
+	mb->fresh = 0;
+
+	memcpy(dst, mb->data[cur], mb->len[cur]);
+
+	age = (sched_now() - mb->stamp[cur]) / (F_CPU / 1000000L);
+	if (age > 0xffff)
+		age = 0xffff;
+
+	mailbox_stats.last_age = age;
+	if (age > mailbox_stats.max_age)
+		mailbox_stats.max_age = age;
+	mailbox_stats.sent++;
+
+	return mb->len[cur];
+}
+
+const struct mailbox_stats *mailbox_getStats(void)
+{
+	return &mailbox_stats;
+}
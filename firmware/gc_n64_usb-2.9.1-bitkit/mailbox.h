@@ -0,0 +1,29 @@
+#ifndef _mailbox_h__
+#define _mailbox_h__
+
+#include "gcn64_protocol.h"
+#include "reportdesc.h"
+
+/* One mailbox per port. With a single port, one per USB interface
+ * (joystick, keyboard). Large enough for all the pad reports. */
+#if GCN64_NUM_PORTS > 1
+#define MAILBOX_COUNT	GCN64_NUM_PORTS
+#else
+#define MAILBOX_COUNT	2
+#endif
+#define MAILBOX_SIZE	GCN64_REPORT_SIZE
+
+struct mailbox_stats {
+	unsigned int last_age;		// uS between poll and send, last report
+	unsigned int max_age;		// uS, since power up
+	unsigned int published;		// samples from the poller
+	unsigned int sent;			// samples given to the USB side
+	unsigned int replaced;		// replaced by a newer one before being sent
+};
+
+unsigned char *mailbox_begin(unsigned char box);
+void mailbox_commit(unsigned char box, unsigned char len);
+unsigned char mailbox_take(unsigned char box, unsigned char *dst);
+const struct mailbox_stats *mailbox_getStats(void);
+
+#endif // _mailbox_h__
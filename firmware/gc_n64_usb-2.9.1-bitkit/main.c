@@ -34,11 +34,15 @@
 
 #include "devdesc.h"
 #include "reportdesc.h"
+#include "sched.h"
+#include "mailbox.h"
+#include "config.h"
+#include "n64pak.h"
+#include "tpak.h"
 
 #define MAX_REPORTS	2
 
 #undef NONSTOP_VIBRATION
-#undef WAIT_FOR_PAD
 
 #if defined(__AVR_ATmega168__) || defined(__AVR_ATmega168A__) || \
 	defined(__AVR_ATmega168P__) || defined(__AVR_ATmega328__) || \
@@ -63,9 +67,9 @@ char usbDescriptorConfiguration[] = { 0 }; // dummy
 uchar my_usbDescriptorConfiguration[] = {    /* USB configuration descriptor */
     9,          /* sizeof(usbDescriptorConfiguration): length of descriptor in bytes */
     USBDESCR_CONFIG,    /* descriptor type */
-    18 + 7 * USB_CFG_HAVE_INTRIN_ENDPOINT + 9, 0,
+    18 + 7 * USB_CFG_HAVE_INTRIN_ENDPOINT + 9 + 25 * USB_CFG_HAVE_INTRIN_ENDPOINT3, 0,
                 /* total length of data returned (including inlined descriptors) */
-    1,          /* number of interfaces in this configuration */
+    1 + USB_CFG_HAVE_INTRIN_ENDPOINT3, /* number of interfaces in this configuration */
     1,          /* index of this configuration */
     0,          /* configuration name string index */
 #if USB_CFG_IS_SELF_POWERED
@@ -88,7 +92,7 @@ uchar my_usbDescriptorConfiguration[] = {    /* USB configuration descriptor */
     9,          /* sizeof(usbDescrHID): length of descriptor in bytes */
     USBDESCR_HID,   /* descriptor type: HID */
     0x01, 0x01, /* BCD representation of HID version */
-/* 22 */    15,       /* target country code : Japan (for keyboard) */
+/* 22 */    0,        /* target country code : not localized */
 /* 23 */    0x01,       /* number of HID Report (or other HID class) Descriptor infos to follow */
 /* 24 */    0x22,       /* descriptor type: report */
 /* 25 */	0, 0, // /* total length of report descriptor. Updated at run-time depending on current gamepad */
@@ -99,14 +103,45 @@ uchar my_usbDescriptorConfiguration[] = {    /* USB configuration descriptor */
     0x81,       /* IN endpoint number 1 */
     0x03,       /* attrib: Interrupt endpoint */
     8, 0,       /* maximum packet size */
-    USB_CFG_INTR_POLL_INTERVAL, /* in ms */
+/* 33 */    USB_CFG_INTR_POLL_INTERVAL, /* in ms. Updated at run-time from the settings (config.c) */
+#endif
+#if USB_CFG_HAVE_INTRIN_ENDPOINT3
+/* Keyboard interface (gc_kb.c). Always there, so connecting a keyboard
+ * instead of a controller (or the reverse) needs no re-enumeration. */
+    9,          /* sizeof(usbDescrInterface): length of descriptor in bytes */
+    USBDESCR_INTERFACE, /* descriptor type */
+    GAMEPAD_INTF_KEYBOARD, /* index of this interface */
+    0,          /* alternate setting for this interface */
+    1,          /* endpoints excl 0: number of endpoint descriptors to follow */
+    0x03,       /* HID */
+    0x01,       /* boot interface */
+    0x01,       /* keyboard */
+    0,          /* string index for interface */
+    9,          /* sizeof(usbDescrHID): length of descriptor in bytes */
+    USBDESCR_HID,   /* descriptor type: HID */
+    0x01, 0x01, /* BCD representation of HID version */
+/* 47 */    15,       /* target country code : Japan (for keyboard) */
+/* 48 */    0x01,       /* number of HID Report (or other HID class) Descriptor infos to follow */
+/* 49 */    0x22,       /* descriptor type: report */
+/* 50 */	0, 0, // /* total length of report descriptor. Updated at run-time */
+    7,          /* sizeof(usbDescrEndpoint) */
+    USBDESCR_ENDPOINT,  /* descriptor type = endpoint */
+    0x80 | USB_CFG_EP3_NUMBER, /* IN endpoint number 3 */
+    0x03,       /* attrib: Interrupt endpoint */
+    8, 0,       /* maximum packet size */
+/* 58 */    USB_CFG_INTR_POLL_INTERVAL, /* in ms. Updated at run-time from the settings (config.c) */
 #endif
 };
 
 
 
 
+#if GCN64_NUM_PORTS > 1
+/* One pad per port, NULL when nothing is connected. */
+static Gamepad *pads[GCN64_NUM_PORTS];
+#else
 static Gamepad *curGamepad = NULL;
+#endif
 
 
 /* ----------------------- hardware I/O abstraction ------------------------ */
@@ -151,13 +186,17 @@ static void hardwareInit(void)
 	TCCR0B = 5;
 	TCCR2A= (1<<WGM21);
 	TCCR2B=(1<<CS22)|(1<<CS21)|(1<<CS20);
-	OCR2A= 50;  // for 240 hz
+	OCR2A= config_getTimerCompare(); // poll rate, 50 for ~240 hz
 #else
 	TCCR0 = 5; // divide by 1024
 	TCCR2 = (1<<WGM21)|(1<<CS22)|(1<<CS21)|(1<<CS20);
-	OCR2 = 50; // for 240 hz
+	OCR2 = config_getTimerCompare(); // poll rate, 50 for ~240 hz
 #endif
 
+	/* Timer1 free running at the CPU clock. Used as time base
+	 * for scheduling and timestamping. */
+	TCCR1A = 0;
+	TCCR1B = (1<<CS10);
 }
 
 static void usbReset(void)
@@ -186,7 +225,50 @@ static void usbReset(void)
 	#define clrRunEffectLoop()		do { TIFR = 1<<TOV0; } while(0)
 #endif
 
-static uchar    reportBuffer[10];    /* buffer for HID reports */
+/* Large enough for the longest feature report (see usbFunctionSetup)
+ * and for a joystick report (GCN64_REPORT_SIZE) */
+#if 1 + 7 * GCN64_NUM_PORTS > N64PAK_REPORT_SIZE
+#define REPORT_BUFFER_SIZE	(1 + 7 * GCN64_NUM_PORTS)
+#else
+#define REPORT_BUFFER_SIZE	N64PAK_REPORT_SIZE
+#endif
+
+static uchar    reportBuffer[REPORT_BUFFER_SIZE];    /* buffer for HID reports */
+
+/* Longest Gamepad afterPoll() task: a 35 byte N64 expansion write
+ * (~1.2ms), with some margin. */
+#define AFTER_POLL_CYCLES	(1500L * (F_CPU / 1000000L))
+
+/* Polls in a row an afterPoll() task may be skipped for lack of time
+ * before it gets a USB interval of its own. See runAfterPoll() */
+#define AFTER_POLL_MAX_SKIPS	4
+
+/* afterPoll() tasks skipped for lack of time, for GCN64_STATS_REPORT */
+static unsigned int after_poll_skipped;
+
+/* Run the pad's afterPoll() task (pak transfers, rumble) if it fits
+ * before the next USB interrupt. With a short bInterval it never does,
+ * so after AFTER_POLL_MAX_SKIPS skips the next interrupt is waited for
+ * and the task gets the whole interval. The slot is not closed with
+ * sched_endSlot(), which would learn the task length as the poll's. */
+static void runAfterPoll(Gamepad *pad, unsigned char *skips)
+{
+	if (sched_timeLeft() < AFTER_POLL_CYCLES) {
+		if (*skips < AFTER_POLL_MAX_SKIPS) {
+			(*skips)++;
+			after_poll_skipped++;
+			return;
+		}
+		sched_waitSlot();
+	}
+
+	*skips = 0;
+	pad->afterPoll();
+}
+
+/* Consecutive failed polls after which a controller is considered gone.
+ * Each poll is already retried (GCN64_RETRIES). */
+#define DISCONNECT_POLLS	3
 
 
 
@@ -210,6 +292,15 @@ usbMsgLen_t   usbFunctionDescriptor(struct usbRequest *rq)
 				return rt_usbDeviceDescriptorSize;
 
 			case USBDESCR_HID_REPORT:
+#if USB_CFG_HAVE_INTRIN_ENDPOINT3
+				// wIndex: interface
+				if (rq->wIndex.bytes[0] == GAMEPAD_INTF_KEYBOARD) {
+					Gamepad *kb = gc_kb_getGamepad();
+
+					usbMsgPtr = kb->reportDescriptor;
+					return kb->reportDescriptorSize;
+				}
+#endif
 				usbMsgPtr = (void*)rt_usbHidReportDescriptor;
 				return rt_usbHidReportDescriptorSize;
 
@@ -222,6 +313,52 @@ usbMsgLen_t   usbFunctionDescriptor(struct usbRequest *rq)
 	return 0;
 }
 
+/* Report for a port without controller: centered axes, no buttons */
+static int getIdleReport(unsigned char *dstbuf, int id)
+{
+	dstbuf[0] = id;
+	memset(dstbuf + 1, 0x7f, GCN64_BUTTONS_OFFSET - 1);
+	dstbuf[GCN64_BUTTONS_OFFSET] = 0;
+	dstbuf[GCN64_BUTTONS_OFFSET + 1] = 0;
+
+	return GCN64_REPORT_SIZE;
+}
+
+#if GCN64_NUM_PORTS > 1
+/* Bit 0 for port 1, bit 1 for port 2... */
+static void gamepadVibrate(char ports)
+{
+	unsigned char prev_port = gcn64_getPort();
+	unsigned char p;
+
+	for (p=0; p<GCN64_NUM_PORTS; p++) {
+		if (pads[p] && pads[p]->setVibration) {
+			gcn64_selectPort(p);
+			pads[p]->setVibration(ports & (1<<p));
+		}
+	}
+
+	gcn64_selectPort(prev_port);
+}
+
+static int getGamepadReport(unsigned char *dstbuf, int id)
+{
+	unsigned char prev_port = gcn64_getPort();
+	int len;
+
+	if (id < 1 || id > GCN64_NUM_PORTS)
+		return 0;
+
+	if (pads[id-1] == NULL)
+		return getIdleReport(dstbuf, id);
+
+	gcn64_selectPort(id - 1);
+	len = pads[id-1]->buildReport(dstbuf, id);
+	gcn64_selectPort(prev_port);
+
+	return len;
+}
+#else
 static void gamepadVibrate(char on)
 {
 	if (curGamepad)
@@ -231,20 +368,9 @@ static void gamepadVibrate(char on)
 
 static int getGamepadReport(unsigned char *dstbuf, int id)
 {
-	if (curGamepad == NULL) {
-		if (id==1) {
-			dstbuf[0] = 1;
-			dstbuf[1] = 0x7f;
-			dstbuf[2] = 0x7f;
-			dstbuf[3] = 0x7f;
-			dstbuf[4] = 0x7f;
-			dstbuf[5] = 0x7f;
-			dstbuf[6] = 0x7f;
-			dstbuf[7] = 0;
-			dstbuf[8] = 0;
-
-			return 9;
-		}
+	if (curGamepad == NULL || curGamepad->usb_interface != GAMEPAD_INTF_JOYSTICK) {
+		if (id==1)
+			return getIdleReport(dstbuf, id);
 		return 0;
 	}
 	else {
@@ -252,6 +378,18 @@ static int getGamepadReport(unsigned char *dstbuf, int id)
 	}
 }
 
+/* Report of the keyboard interface: nothing pressed, unless a keyboard
+ * is what is connected. */
+static int getKeyboardReport(unsigned char *dstbuf)
+{
+	if (curGamepad && curGamepad->usb_interface == GAMEPAD_INTF_KEYBOARD)
+		return curGamepad->buildReport(dstbuf, 1);
+
+	memset(dstbuf, 0, GC_KB_REPORT_SIZE);
+	return GC_KB_REPORT_SIZE;
+}
+#endif
+
 static unsigned char _FFB_effect_index;
 #define LOOP_MAX	0xFFFF
 static unsigned int _loop_count;
@@ -282,13 +420,58 @@ static void effect_loop()
 #define PID_SIMULTANEOUS_MAX	3
 #define PID_BLOCK_LOAD_REPORT	2
 
+// Vendor defined feature reports
+#define GCN64_PROFILE_REPORT	0x10
+#define GCN64_STATS_REPORT		0x11
+#define GCN64_RUMBLE_REPORT		0x12 // output, multi-port only
+#define GCN64_LATENCY_REPORT	0x13
+#define GCN64_CONFIG_REPORT		0x14
+#define GCN64_HYSTERESIS_REPORT	0x15
+#define GCN64_PAK_REPORT		0x16
+#define GCN64_TPAK_REPORT		0x17
+
+/* Reports longer than 8 bytes written by the host arrive in several
+ * usbFunctionWrite() calls. They are gathered in reportBuffer. What does
+ * not fit (the unused end of a transfer pak report) is dropped. */
+static unsigned char long_write_len, long_write_remaining;
+
+#if USB_CFG_HAVE_INTRIN_ENDPOINT3
+static unsigned char kb_protocol = 1; // report protocol
+#endif
+
 usbMsgLen_t	usbFunctionSetup(uchar data[8])
 {
 	usbRequest_t    *rq = (void *)data;
 
+	// A new request ends any long write, even one the host abandoned.
+	// Only a pak SET_REPORT starts one (below).
+	long_write_len = 0;
+	long_write_remaining = 0;
+
 	usbMsgPtr = reportBuffer;
 	if((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_CLASS){    /* class request type */
 
+#if USB_CFG_HAVE_INTRIN_ENDPOINT3
+		// wIndex: interface. The boot protocol report is the same as the
+		// report protocol one. There are no LEDs (SET_REPORT is ignored).
+		if (rq->wIndex.bytes[0] == GAMEPAD_INTF_KEYBOARD) {
+			switch (rq->bRequest)
+			{
+				case USBRQ_HID_GET_REPORT:
+					return getKeyboardReport(reportBuffer);
+
+				case USBRQ_HID_GET_PROTOCOL:
+					reportBuffer[0] = kb_protocol;
+					return 1;
+
+				case USBRQ_HID_SET_PROTOCOL:
+					kb_protocol = rq->wValue.bytes[0];
+					break;
+			}
+			return 0;
+		}
+#endif
+
 		switch(rq->bRequest)
 		{
 			case USBRQ_HID_GET_REPORT:
@@ -340,6 +523,89 @@ usbMsgLen_t	usbFunctionSetup(uchar data[8])
 								reportBuffer[4] = 1;
 								return 5;
 							}
+							else if (rq->wValue.bytes[0] == GCN64_PROFILE_REPORT) {
+								unsigned char p, *dst = reportBuffer + 1;
+
+								// 7 bytes for each port
+								reportBuffer[0] = rq->wValue.bytes[0];
+								for (p=0; p<GCN64_NUM_PORTS; p++) {
+									const struct gcn64_timing_profile *prof = gcn64_getTimingProfile(p);
+
+									*dst++ = prof->low1;
+									*dst++ = prof->high1;
+									*dst++ = prof->low0;
+									*dst++ = prof->high0;
+									*dst++ = prof->bias;
+									*dst++ = prof->ones;
+									*dst++ = prof->calibrations;
+								}
+								return 1 + 7 * GCN64_NUM_PORTS;
+							}
+							else if (rq->wValue.bytes[0] == GCN64_STATS_REPORT) {
+								const struct gcn64_stats *st = gcn64_getStats();
+								unsigned int values[GCN64_STATS_VALUES] = { st->transactions,
+									st->timeouts, st->framing_errors, st->short_replies,
+									st->first_try, st->retried, st->failed, st->max_bit_time,
+									after_poll_skipped, sched_getCollisions(),
+#ifdef GCN64_TIMER_RX
+									gcn64_getCollisionCount(),
+#endif
+								};
+								int i;
+
+								// 16 bit values, little endian.
+								reportBuffer[0] = rq->wValue.bytes[0];
+								for (i=0; i<GCN64_STATS_VALUES; i++) {
+									reportBuffer[1+i*2] = values[i];
+									reportBuffer[2+i*2] = values[i] >> 8;
+								}
+								return 1 + GCN64_STATS_VALUES * 2;
+							}
+							else if (rq->wValue.bytes[0] == GCN64_LATENCY_REPORT) {
+								const struct mailbox_stats *st = mailbox_getStats();
+								unsigned int values[5] = { st->last_age, st->max_age,
+									st->published, st->sent, st->replaced };
+								int i;
+
+								// 16 bit values, little endian.
+								reportBuffer[0] = rq->wValue.bytes[0];
+								for (i=0; i<5; i++) {
+									reportBuffer[1+i*2] = values[i];
+									reportBuffer[2+i*2] = values[i] >> 8;
+								}
+								return 11;
+							}
+							else if (rq->wValue.bytes[0] == GCN64_CONFIG_REPORT) {
+								// 16 bit values, little endian: effective poll rate
+								// (Hz, at most 1000/bInterval), bInterval (ms),
+								// maximum poll rate (Hz). Values written are used
+								// from the next enumeration on.
+								reportBuffer[0] = rq->wValue.bytes[0];
+								reportBuffer[1] = config_getEffectivePollRate();
+								reportBuffer[2] = config_getEffectivePollRate() >> 8;
+								reportBuffer[3] = config_getInterval();
+								reportBuffer[4] = 0;
+								reportBuffer[5] = CONFIG_MAX_POLL_RATE & 0xff;
+								reportBuffer[6] = CONFIG_MAX_POLL_RATE >> 8;
+								return 7;
+							}
+							else if (rq->wValue.bytes[0] == GCN64_HYSTERESIS_REPORT) {
+								// Axis change threshold, in 8-bit steps
+								reportBuffer[0] = rq->wValue.bytes[0];
+								reportBuffer[1] = config_getHysteresis();
+								return 2;
+							}
+							else if (rq->wValue.bytes[0] == GCN64_PAK_REPORT) {
+								// See n64pak.c
+								reportBuffer[0] = rq->wValue.bytes[0];
+								return n64pak_getReport(reportBuffer);
+							}
+							else if (rq->wValue.bytes[0] == GCN64_TPAK_REPORT) {
+								// See tpak.c. Chunks are sent from where they were read.
+								uchar len = tpak_getReport(&usbMsgPtr);
+								usbMsgPtr[0] = rq->wValue.bytes[0];
+								return len;
+							}
 							break;
 					}
 #endif
@@ -347,6 +613,10 @@ usbMsgLen_t	usbFunctionSetup(uchar data[8])
 
 			case USBRQ_HID_SET_REPORT:
 				{
+					if (rq->wValue.bytes[0] == GCN64_PAK_REPORT ||
+							rq->wValue.bytes[0] == GCN64_TPAK_REPORT) {
+						long_write_remaining = rq->wLength.word > 0xff ? 0xff : rq->wLength.word;
+					}
 					return USB_NO_MSG;
 				}
 		}
@@ -387,6 +657,31 @@ static void decideVibration(void)
 
 uchar usbFunctionWrite(uchar *data, uchar len)
 {
+	if (long_write_remaining) {
+		uchar keep;
+
+		if (len > long_write_remaining)
+			len = long_write_remaining;
+		keep = len;
+		if (long_write_len + keep > REPORT_BUFFER_SIZE)
+			keep = REPORT_BUFFER_SIZE - long_write_len;
+		memcpy(reportBuffer + long_write_len, data, keep);
+		long_write_len += keep;
+		long_write_remaining -= len;
+		if (long_write_remaining)
+			return 0; // more to come
+
+		// Refused (STALL) while busy. The host retries.
+		if (reportBuffer[0] == GCN64_TPAK_REPORT) {
+			if (tpak_request(reportBuffer, long_write_len))
+				return 0xff;
+		} else {
+			if (n64pak_request(reportBuffer, long_write_len))
+				return 0xff;
+		}
+		return 1;
+	}
+
 	if (len < 1)
 		return 1;
 
@@ -424,6 +719,24 @@ uchar usbFunctionWrite(uchar *data, uchar len)
 			decideVibration();
 			break;
 
+#if GCN64_NUM_PORTS > 1
+		case GCN64_RUMBLE_REPORT:
+			gamepadVibrate(data[1]);
+			break;
+#endif
+
+		case GCN64_CONFIG_REPORT:
+			// Refuse (STALL) rates out of range. Rates above what
+			// bInterval allows are lowered, read back to see it.
+			if (len < 5 || data[4] || config_set(data[1] | (data[2] << 8), data[3]))
+				return 0xff;
+			break;
+
+		case GCN64_HYSTERESIS_REPORT:
+			if (len < 2 || config_setHysteresis(data[1]))
+				return 0xff;
+			break;
+
 		case REPORT_EFFECT_OPERATION:
 			if (len != 4)
 				return 1;
@@ -483,38 +796,320 @@ uchar usbFunctionWrite(uchar *data, uchar len)
 
 /* ------------------------------------------------------------------------- */
 
-void transferGamepadReport(int id)
+/* Interrupt data. Not reportBuffer, which a control transfer serviced
+ * between two 8 byte parts of a report would overwrite. */
+static uchar intrBuffer[MAILBOX_SIZE];
+
+/* Put the current report of a pad in its mailbox (see mailbox.c) */
+static void publishReport(unsigned char box, int id)
 {
-	if (usbInterruptIsReady())
-	{
-		char len;
-		int xfer_len;
-		int j;
+#if USB_CFG_HAVE_INTRIN_ENDPOINT3
+	if (box == GAMEPAD_INTF_KEYBOARD) {
+		mailbox_commit(box, getKeyboardReport(mailbox_begin(box)));
+		return;
+	}
+#endif
+	mailbox_commit(box, getGamepadReport(mailbox_begin(box), id));
+}
+
+/* With a single port, each mailbox is for an interface, and the keyboard
+ * interface has its own endpoint. */
+#if USB_CFG_HAVE_INTRIN_ENDPOINT3
+#define boxIsReady(box)	((box) == GAMEPAD_INTF_KEYBOARD ? \
+							usbInterruptIsReady3() : usbInterruptIsReady())
+#define boxSend(box, p, len)	do { if ((box) == GAMEPAD_INTF_KEYBOARD) \
+							usbSetInterrupt3(p, len); else usbSetInterrupt(p, len); } while(0)
+#else
+#define boxIsReady(box)			usbInterruptIsReady()
+#define boxSend(box, p, len)	usbSetInterrupt(p, len)
+#endif
+
+/* Send the freshest samples, as soon as the interrupt endpoint is free.
+ * Mailboxes are visited in turn, starting after the last one sent. */
+static void sendSamples(void)
+{
+	static unsigned char next_box = 0;
+	unsigned char i, box, len, j, xfer_len;
+
+	for (i=0; i<MAILBOX_COUNT; i++) {
+		box = next_box;
+		if (++next_box >= MAILBOX_COUNT)
+			next_box = 0;
+
+		if (!boxIsReady(box))
+			continue;
 
-		len = getGamepadReport(reportBuffer, id);
+		len = mailbox_take(box, intrBuffer);
 
 		for (j=0; j<len; j+=8)
 		{
 			xfer_len = (len-j) < 8 ? (len-j) : 8;
 
-			while (!usbInterruptIsReady())
+			while (!boxIsReady(box))
 			{
 				usbPoll();
 				wdt_reset();
 			}
-			usbSetInterrupt(reportBuffer+j, xfer_len);
+			boxSend(box, intrBuffer+j, xfer_len);
+		}
+	}
+}
+
+#if GCN64_NUM_PORTS > 1
+/* Multi-port operation
+ *
+ * Each port has its own pad, state and report ID (port + 1). The report
+ * descriptor does not depend on what is connected, so pads are added
+ * and removed without re-enumerating. Empty ports are checked every
+ * DETECT_INTERVAL polls, using the ID command only (no bruteforce
+ * probing, no keyboard). Rumble is controlled per port with
+ * GCN64_RUMBLE_REPORT.
+ *
+ * All ports are polled at each tick. When the time left before the next
+ * USB interrupt is too short for one more pad, the next burst is waited
+ * for (see sched.c).
+ *
+ * With GCN64_PARALLEL_POLL, pads are updated in two steps. What comes
+ * before the status poll (ID, rumble commands...) is still done port by
+ * port, then the status poll is sent to all the pads of the same type at
+ * once (gcn64_transactionParallel).
+ */
+
+/* Polls between detection attempts on empty ports (~250ms) */
+#define DETECT_INTERVAL		60
+
+/* Worst case for one pad: GC ID + status, with a retry */
+#define PORT_POLL_CYCLES	(900L * (F_CPU / 1000000L))
+
+static unsigned char port_errors[GCN64_NUM_PORTS];
+static unsigned char after_poll_skips[GCN64_NUM_PORTS];
+
+/* Account for the result of a pad update.
+ * Returns non-zero if a report must be sent for this port. */
+static char multiport_updated(unsigned char p, char error)
+{
+	if (error) {
+		// Detect disconnection
+		if (++port_errors[p] >= DISCONNECT_POLLS) {
+			pads[p] = NULL;
+			return 1; // idle report
+		}
+		return 0;
+	}
+
+	port_errors[p] = 0;
+	return pads[p]->changed(p+1) ? 1 : 0;
+}
+
+#ifdef GCN64_PARALLEL_POLL
+static unsigned char poll_cmds[GCN64_NUM_PORTS][GCN64_PAR_MAX_CMD];
+
+/* Send the status polls prepared by buildPoll(), grouping the pads
+ * of the same type. Returns the ports to report. */
+static unsigned char multiport_pollParallel(unsigned char pending)
+{
+	unsigned char must_report = 0;
+	unsigned char group, ok, p;
+	Gamepad *type;
+
+	while (pending) {
+		for (p=0; !(pending & (1<<p)); p++)
+			;
+
+		type = pads[p];
+		group = 0;
+		for (; p<GCN64_NUM_PORTS; p++) {
+			if ((pending & (1<<p)) && pads[p] == type)
+				group |= 1<<p;
+		}
+		pending &= ~group;
+
+		if (sched_timeLeft() < PORT_POLL_CYCLES) {
+			sched_endSlot();
+			sched_waitSlot();
+		}
+
+		ok = gcn64_transactionParallel(group, poll_cmds, type->pollLength, type->pollReplyBits);
+
+		for (p=0; p<GCN64_NUM_PORTS; p++) {
+			if (!(group & (1<<p)))
+				continue;
+
+			gcn64_selectPort(p);
+			if (multiport_updated(p, !(ok & (1<<p)) || type->parsePoll())) {
+				must_report |= 1<<p;
+			}
+		}
+	}
+
+	return must_report;
+}
+#endif
+
+static Gamepad *multiport_detect(void)
+{
+	Gamepad *pad = NULL;
+
+	switch (gcn64_detectController())
+	{
+		case CONTROLLER_IS_N64:
+			pad = n64GetGamepad();
+			break;
+
+		case CONTROLLER_IS_GC:
+			pad = gamecubeGetGamepad();
+			break;
+	}
+
+	if (pad) {
+		pad->init();
+	}
+
+	return pad;
+}
+
+static void multiport_doTasks(void)
+{
+	static unsigned char detect_countdown = 0;
+	unsigned char must_report = 0;
+	unsigned char detect = 0;
+	unsigned char polled = 0;
+#ifdef GCN64_PARALLEL_POLL
+	unsigned char pending = 0;
+#endif
+	unsigned char p;
+
+	wdt_reset();
+
+	// this must be called at each 50 ms or less
+	usbPoll();
+
+	if (mustPollControllers())
+	{
+		clrPollControllers();
+		polled = 1;
+
+		if (detect_countdown) {
+			detect_countdown--;
+		} else {
+			detect_countdown = DETECT_INTERVAL;
+			detect = 1;
+		}
+
+		sched_waitSlot();
+
+		for (p=0; p<GCN64_NUM_PORTS; p++) {
+			if (!pads[p] && !detect)
+				continue;
+
+			if (sched_timeLeft() < PORT_POLL_CYCLES) {
+				sched_endSlot();
+				sched_waitSlot();
+			}
+
+			gcn64_selectPort(p);
+
+			if (!pads[p]) {
+				pads[p] = multiport_detect();
+				port_errors[p] = 0;
+				if (pads[p]) {
+					must_report |= 1<<p;
+				}
+				continue;
+			}
+
+#ifdef GCN64_PARALLEL_POLL
+			if (pads[p]->buildPoll) {
+				if (pads[p]->buildPoll(poll_cmds[p])) {
+					if (multiport_updated(p, 1)) {
+						must_report |= 1<<p;
+					}
+				} else {
+					pending |= 1<<p;
+				}
+				continue;
+			}
+#endif
+
+			if (multiport_updated(p, pads[p]->update())) {
+				must_report |= 1<<p;
+			}
+		}
+
+#ifdef GCN64_PARALLEL_POLL
+		must_report |= multiport_pollParallel(pending);
+#endif
+
+		sched_endSlot();
+	}
+
+	if (mustRunEffectLoop())
+	{
+		clrRunEffectLoop();
+		effect_loop();
+	}
+
+	for (p=0; p<GCN64_NUM_PORTS; p++) {
+		if (must_report & (1<<p)) {
+			publishReport(p, p+1);
+		}
+	}
 
+	sendSamples();
+
+	// Only now that the samples are out.
+	if (polled) {
+		for (p=0; p<GCN64_NUM_PORTS; p++) {
+			if (!pads[p] || !pads[p]->afterPoll || port_errors[p])
+				continue;
+
+			gcn64_selectPort(p);
+			runAfterPoll(pads[p], &after_poll_skips[p]);
 		}
 	}
 }
 
+int main(void)
+{
+	config_init();
+	hardwareInit();
+	gcn64protocol_hwinit();
+
+	rt_usbHidReportDescriptor = (void*)gcn64_multiUsbHidReportDescriptor;
+	rt_usbHidReportDescriptorSize = getMultiUsbHidReportDescriptor_size();
+	rt_usbDeviceDescriptor = (void*)usbDescrDevice;
+	rt_usbDeviceDescriptorSize = getUsbDescrDevice_size();
+
+	// patch the config descriptor with the HID report descriptor size
+	my_usbDescriptorConfiguration[25] = rt_usbHidReportDescriptorSize;
+	my_usbDescriptorConfiguration[26] = rt_usbHidReportDescriptorSize >> 8;
+	my_usbDescriptorConfiguration[33] = config_getInterval();
+
+	wdt_enable(WDTO_2S);
+	usbInit();
+	usbReset();
+	sei();
+
+	while (1)
+	{
+		sched_now(); // see sched.c
+		multiport_doTasks();
+		config_save();
+	}
+
+	return 0;
+}
+
+#else // GCN64_NUM_PORTS > 1
+
 /* Poll the controller
  * Send reports
  */
 static void controller_present_doTasks(char just_changed)
 {{{
-	char must_report = 0;
 	static int error_count = 0;
+	static unsigned char after_poll_skips = 0;
+	char polled = 0;
 	int i;
 
 	/* main event loop */
@@ -526,52 +1121,59 @@ static void controller_present_doTasks(char just_changed)
 	if (just_changed) {
 		gamepadVibrate(0);
 		error_count = 0;
+
+		// init() has read the controller. Report it now rather than
+		// after the next poll.
+		for (i=0; i<curGamepad->num_reports; i++) {
+			publishReport(curGamepad->usb_interface, i+1);
+		}
 	}
 
 	/* Poll the controller at the configured speed */
 	if (mustPollControllers())
 	{
 		clrPollControllers();
-		
-		if (!must_report)
-		{
-			decideVibration();
 
-			// Wait! Before doing this, let an USB interrupt occur. This
-			// prevents USB interrupts from occuring during the
-			// timing sensitive Gamecube/N64 communication.
-			//
-			// USB communication interrupts are triggering at regular
-			// intervals on my machine. Between interrupts, we have 900uS of
-			// free time.
-			//
-			// The trick here is to put the CPU in idle mode ; That is, wating
-			// for interrupts, doing nothing. When the CPU resumes, an interrupt
-			// has been serviced. The final delay helps when we get more than
-			// once in a row (it happens, saw it on the scope. It was inserting
-			// a huge delay in the command I was sending to the controller)
-			//
-			wdt_disable();
-			sleep_enable();
-			sleep_cpu();
-			sleep_disable();
-			_delay_us(100);
-			wdt_enable(WDTO_2S);
-
-			if (curGamepad->update()) {
-				error_count++;
-			} else {
-				error_count = 0;
-			}
+		decideVibration();
+
+		// Wait! Before doing this, let an USB interrupt occur. This
+		// prevents USB interrupts from occuring during the
+		// timing sensitive Gamecube/N64 communication.
+		//
+		// USB communication interrupts are triggering at regular
+		// intervals on my machine. Between interrupts, we have 900uS of
+		// free time.
+		//
+		// See sched.c
+		sched_waitSlot();
+		polled = 1;
+
+		if (curGamepad->update()) {
+			error_count++;
+		} else {
+			error_count = 0;
+		}
 
-			/* Check what will have to be reported */
-			for (i=0; i<curGamepad->num_reports; i++) {
-				if (curGamepad->changed(i+1)) {
-					must_report |= (1<<i);
-				}
-			}
+		sched_endSlot();
+
+		// Detect disconnection
+		if (error_count >= DISCONNECT_POLLS) {
+			curGamepad = NULL;
+
+			// Release what the controller was holding
+			publishReport(GAMEPAD_INTF_JOYSTICK, 1);
+			publishReport(GAMEPAD_INTF_KEYBOARD, 1);
+			sendSamples();
+			return;
 		}
 
+		/* Publish what changed. It is sent when the
+		 * host is ready for it (see sendSamples) */
+		for (i=0; i<curGamepad->num_reports; i++) {
+			if (curGamepad->changed(i+1)) {
+				publishReport(curGamepad->usb_interface, i+1);
+			}
+		}
 	}
 
 	if (mustRunEffectLoop()) 
@@ -581,80 +1183,127 @@ static void controller_present_doTasks(char just_changed)
 
 	}
 
-	if(must_report)
-	{
-		for (i = 0; i < curGamepad->num_reports; i++)
-		{
-			if ((must_report & (1<<i)) == 0)
-				continue;
-
-
-			transferGamepadReport(i+1);
-		}
-
-		must_report = 0;
-	}
+	sendSamples();
 
-	// Detect disconnection
-	if (error_count > 30) {
-		curGamepad = NULL;
+	// Only now that the sample is out.
+	if (polled && !error_count && curGamepad->afterPoll) {
+		runAfterPoll(curGamepad, &after_poll_skips);
 	}
 }}}
 
-Gamepad *tryDetectController(void)
-{{{
-	Gamepad *pad = NULL;
-
-	gamepadVibrate(0);
+/* Controller detection, driven from the main loop. Each step takes one
+ * poll period and sends one command, or does what a regular poll would
+ * (pad init), so USB and the effect loop keep running meanwhile.
+ *
+ * DETECT_ID asks for the controller ID at every poll until something
+ * answers. The same reply calibrates the bit timings (see
+ * gcn64_detectController). A recognized ID goes straight to DETECT_INIT,
+ * whose reading of the controller is reported right away. A poll waits
+ * for the next USB interrupt, so a step is one bInterval when polling
+ * is faster than USB. With the default 5ms, a controller answers the ID
+ * command at most 5ms after being plugged, its first report is ready
+ * 5ms later, and sent at the next poll of the host: 15ms at most.
+ *
+ * An unusual reply falls back to probing each type in turn
+ * (DETECT_PROBE), starting with the type that was last detected, as the
+ * same controller is usually plugged back.
+ */
+#define DETECT_ID		0
+#define DETECT_PROBE	1
+#define DETECT_INIT		2
 
-	// this must be called at each 50 ms or less
-	usbPoll();
-	transferGamepadReport(1); // We know they all have only one
-	_delay_ms(30);
-	usbPoll();
+static unsigned char detect_state = DETECT_ID;
+static unsigned char detect_type;	// CONTROLLER_IS_*, for DETECT_PROBE/INIT
+static unsigned char detect_probes;	// types probed so far
+static unsigned char last_type = CONTROLLER_IS_GC;
 
-	switch(gcn64_detectController())
+static Gamepad *getGamepadOfType(unsigned char type)
+{
+	switch (type)
 	{
 		case CONTROLLER_IS_N64:
-			pad = n64GetGamepad();
-			pad->init();
-			break;
+			return n64GetGamepad();
+		case CONTROLLER_IS_GC_KEYBOARD:
+			return gc_kb_getGamepad();
+		default:
+			return gamecubeGetGamepad();
+	}
+}
 
-		case CONTROLLER_IS_GC:
-			pad = gamecubeGetGamepad();
-			pad->init();
-			break;
+/* Returns the controller once it is initialized */
+static Gamepad *detectStep(void)
+{
+	Gamepad *pad;
+	unsigned char type;
 
-		case CONTROLLER_IS_GC_KEYBOARD:
-			pad = gc_kb_getGamepad();
-			pad->init();
-			break;
+	switch (detect_state)
+	{
+		case DETECT_ID:
+			type = gcn64_detectController();
+			if (type == CONTROLLER_IS_ABSENT)
+				break;
 
-			// Unknown means weird reply from the controller
-			// try the old, bruteforce approach.
-		case CONTROLLER_IS_UNKNOWN:
-			/* Check for gamecube controller */
-			pad = gamecubeGetGamepad();
-			pad->init();
-			if (pad->probe()) {
+			if (type == CONTROLLER_IS_UNKNOWN) {
+				// Weird reply from the controller. Try the old,
+				// bruteforce approach.
+				detect_type = last_type == CONTROLLER_IS_N64 ?
+									CONTROLLER_IS_N64 : CONTROLLER_IS_GC;
+				detect_probes = 0;
+				detect_state = DETECT_PROBE;
 				break;
 			}
 
-			usbPoll();
-			_delay_ms(40);
-			usbPoll();
+			detect_type = type;
+			detect_state = DETECT_INIT;
+			break;
+
+		case DETECT_PROBE:
+			if (getGamepadOfType(detect_type)->probe()) {
+				detect_state = DETECT_INIT;
+				break;
+			}
 
-			/* Check for n64 controller */
-			pad = n64GetGamepad();
-			pad->init();
-			if (pad->probe())  {
+			if (++detect_probes >= 2) {
+				detect_state = DETECT_ID;
 				break;
 			}
 
-			pad = NULL;
+			detect_type = detect_type == CONTROLLER_IS_N64 ?
+									CONTROLLER_IS_GC : CONTROLLER_IS_N64;
 			break;
+
+		case DETECT_INIT:
+			pad = getGamepadOfType(detect_type);
+			pad->init();
+			last_type = detect_type;
+			detect_state = DETECT_ID;
+			return pad;
+	}
+
+	return NULL;
+}
+
+/* No controller: one detection step per poll period */
+static Gamepad *controller_absent_doTasks(void)
+{{{
+	Gamepad *pad = NULL;
+
+	wdt_reset();
+
+	// this must be called at each 50 ms or less
+	usbPoll();
+
+	if (mustPollControllers())
+	{
+		clrPollControllers();
+
+		sched_waitSlot();
+		pad = detectStep();
+		sched_endSlot();
 	}
 
+	sendSamples();
+
 	return pad;
 }}}
 
@@ -663,50 +1312,26 @@ int main(void)
 	char just_detected = 1;
 	Gamepad *pad = NULL;
 
+	config_init();
 	hardwareInit();
 	gcn64protocol_hwinit();
 
-#ifdef WAIT_FOR_PAD
-	do {
-		pad = tryDetectController();
-	} while (pad == NULL);
-	curGamepad = pad;
-#else
-	int i = 60;
-	do {
-		pad = tryDetectController();
-		if (pad) {
-			curGamepad = pad;
-			break;
-		}
-		_delay_ms(16);
-	} while (--i);
-#endif
-
-reconnect:
-	cli();
-
-	if (curGamepad && curGamepad->reportDescriptor) {
-		rt_usbHidReportDescriptor = curGamepad->reportDescriptor;
-		rt_usbHidReportDescriptorSize = curGamepad->reportDescriptorSize;
-	} else {
-		rt_usbHidReportDescriptor = (void*)gcn64_usbHidReportDescriptor;
-		rt_usbHidReportDescriptorSize = getUsbHidReportDescriptor_size();
-	}
-
-	if (curGamepad && curGamepad->deviceDescriptor) {
-		rt_usbDeviceDescriptor = curGamepad->deviceDescriptor;
-		rt_usbDeviceDescriptorSize = curGamepad->deviceDescriptorSize;
-	} else {
-		rt_usbDeviceDescriptor = (void*)usbDescrDevice;
-		rt_usbDeviceDescriptorSize = getUsbDescrDevice_size();
-	}
+	// The joystick and keyboard interfaces are always there, whatever
+	// is connected. Controllers are swapped without re-enumerating.
+	rt_usbHidReportDescriptor = (void*)gcn64_usbHidReportDescriptor;
+	rt_usbHidReportDescriptorSize = getUsbHidReportDescriptor_size();
+	rt_usbDeviceDescriptor = (void*)usbDescrDevice;
+	rt_usbDeviceDescriptorSize = getUsbDescrDevice_size();
 
-	// patch the config descriptor with the HID report descriptor size
+	// patch the config descriptor with the HID report descriptor sizes
 	my_usbDescriptorConfiguration[25] = rt_usbHidReportDescriptorSize;
 	my_usbDescriptorConfiguration[26] = rt_usbHidReportDescriptorSize >> 8;
-
-	// Do hardwareInit again. It causes a USB reset.
+	my_usbDescriptorConfiguration[33] = config_getInterval();
+#if USB_CFG_HAVE_INTRIN_ENDPOINT3
+	my_usbDescriptorConfiguration[50] = gc_kb_getGamepad()->reportDescriptorSize;
+	my_usbDescriptorConfiguration[51] = gc_kb_getGamepad()->reportDescriptorSize >> 8;
+	my_usbDescriptorConfiguration[58] = config_getInterval();
+#endif
 
 	wdt_enable(WDTO_2S);
 	usbInit();
@@ -717,16 +1342,13 @@ reconnect:
 	{
 		usbPoll();
 		wdt_reset();
+		sched_now(); // see sched.c
 
 		if (curGamepad == NULL) {
-			pad = tryDetectController();
+			pad = controller_absent_doTasks();
 			if (pad) {
 				curGamepad = pad;
 				just_detected = 1;
-
-				if (pad->reportDescriptor != rt_usbHidReportDescriptor) {
-					goto reconnect;
-				}
 			}
 		}
 
@@ -734,9 +1356,13 @@ reconnect:
 			controller_present_doTasks(just_detected);
 			just_detected = 0;
 		}
+
+		config_save();
 	}
 	return 0;
 }
 
+#endif // GCN64_NUM_PORTS > 1
+
 
 /* ------------------------------------------------------------------------- */
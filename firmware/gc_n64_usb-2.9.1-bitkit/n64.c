@@ -16,12 +16,16 @@
 */
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 #include <string.h>
 #include "gamepad.h"
 #include "leds.h"
 #include "n64.h"
 #include "reportdesc.h"
+#include "axis_lut.h"
+#include "n64pak.h"
+#include "tpak.h"
 #include "gcn64_protocol.h"
 #include "usbdrv.h"
 
@@ -34,34 +38,53 @@ static char n64Changed(int id);
 static int n64BuildReport(unsigned char *reportBuffer, int id);
 static void n64SetVibration(int value);
 
-static char must_rumble = 0;
 #ifdef BUTTON_A_RUMBLE_TEST
 static char force_rumble = 0;
 #endif
 
-/* What was most recently read from the controller */
-static unsigned char last_built_report[GCN64_REPORT_SIZE];
+#define RSTATE_INIT			0
+#define RSTATE_OFF			1
+#define RSTATE_TURNON		2	// motor state unknown, or last write failed
+#define RSTATE_ON			3
+#define RSTATE_TURNOFF		4	// motor state unknown, or last write failed
+#define RSTATE_UNAVAILABLE	5
+
+/* Attempts at initialising a rumble pak before giving up on it */
+#define RUMBLE_INIT_ATTEMPTS	2
 
-/* What was most recently sent to the host */
-static unsigned char last_sent_report[GCN64_REPORT_SIZE];
+/* Minimum n64AfterPoll() calls (~polls) between two rumble pak writes */
+#define RUMBLE_HOLDOFF			4
+
+/* State of the controller on each port. See gcn64_selectPort() */
+struct n64_pad {
+	/* What was most recently read from the controller */
+	unsigned char last_built_report[GCN64_REPORT_SIZE];
+
+	/* What was most recently sent to the host */
+	unsigned char last_sent_report[GCN64_REPORT_SIZE];
+	unsigned char quiet_polls;	// see gcn64_reportChanged()
+
+	char must_rumble;
+	unsigned char rumble_state;
+	unsigned char rumble_init_failures;
+	unsigned char rumble_holdoff;
+};
+
+static struct n64_pad n64_pads[GCN64_NUM_PORTS];
+unsigned char tmpdata[40];
 
 static void n64Init(void)
 {
+#if GCN64_NUM_PORTS < 4
 	// rumble on debug
 	DDRC |= 0x01; // PC0
 	PORTC &= ~0x01;
+#endif
+	n64_pads[gcn64_getPort()].rumble_state = RSTATE_UNAVAILABLE;
+	gcn64_housekeepingNow();
 	n64Update();
 }
 
-#define RSTATE_INIT			0
-#define RSTATE_OFF			1
-#define RSTATE_TURNON		2
-#define RSTATE_ON			3
-#define RSTATE_TURNOFF		4
-#define RSTATE_UNAVAILABLE	5
-static unsigned char n64_rumble_state = RSTATE_UNAVAILABLE;
-unsigned char tmpdata[40];
-
 static char initRumble(void)
 {
 	int count;
@@ -72,8 +95,8 @@ static char initRumble(void)
 	memset(tmpdata+3, 0x80, 32);
 
 	/* Note: The old test (count > 0) was not reliable. */
-	count = gcn64_transaction(tmpdata, 35);
-	if (count == 8)
+	count = gcn64_transaction(tmpdata, 35, N64_EXPANSION_WRITE_REPLY_LENGTH);
+	if (count == N64_EXPANSION_WRITE_REPLY_LENGTH)
 		return 0;
 
 	return -1;
@@ -87,20 +110,17 @@ static char controlRumble(char enable)
 	tmpdata[1] = 0xc0;
 	tmpdata[2] = 0x1b;
 	memset(tmpdata+3, enable ? 0x01 : 0x00, 32);
-	count = gcn64_transaction(tmpdata, 35);
-	if (count == 8)
+	count = gcn64_transaction(tmpdata, 35, N64_EXPANSION_WRITE_REPLY_LENGTH);
+	if (count == N64_EXPANSION_WRITE_REPLY_LENGTH)
 		return 0;
 
 	return -1;
 }
 
-static char n64Update(void)
+static char n64BuildPoll(unsigned char *cmd)
 {
-	int i;
+	struct n64_pad *pad = &n64_pads[gcn64_getPort()];
 	unsigned char count;
-	unsigned char x,y;
-	unsigned char btns1, btns2;
-	unsigned char rb1, rb2;
 	unsigned char caps[3];
 
 	/* Pad answer to N64_GET_CAPABILITIES
@@ -111,85 +131,127 @@ static char n64Update(void)
 	 *
 	 * Bit 0 tells us if there is something connected to the expansion port.
 	 * Bit 1 tells is if there was something connected that has been removed.
+	 *
+	 * Only asked every few polls (see gcn64_housekeepingDue()). Pack insertion
+	 * or removal is noticed within GCN64_HOUSEKEEPING_INTERVAL polls.
 	 */
-	tmpdata[0] = N64_GET_CAPABILITIES;
-	count = gcn64_transaction(tmpdata, 1);
-	if (count != N64_CAPS_REPLY_LENGTH) {
-		// a failed read could mean the pack or controller was gone. Init
-		// will be necessary next time we detect a pack is present.
-		n64_rumble_state = RSTATE_INIT;
-		return -1;
-	}
+	if (gcn64_housekeepingDue()) {
+		tmpdata[0] = N64_GET_CAPABILITIES;
+		count = gcn64_transaction(tmpdata, 1, N64_CAPS_REPLY_LENGTH);
+		if (count != N64_CAPS_REPLY_LENGTH) {
+			// a failed read could mean the pack or controller was gone. Init
+			// will be necessary next time we detect a pack is present.
+			pad->rumble_state = RSTATE_INIT;
+			pad->rumble_init_failures = 0;
+			return -1;
+		}
+
+		caps[0] = gcn64_protocol_getByte(0);
+		caps[1] = gcn64_protocol_getByte(8);
+		caps[2] = gcn64_protocol_getByte(16);
 
-	caps[0] = gcn64_protocol_getByte(0);
-	caps[1] = gcn64_protocol_getByte(8);
-	caps[2] = gcn64_protocol_getByte(16);
+		/* Detect when a pack becomes present and schedule initialisation when it happens. */
+		if ((caps[2] & 0x01) && (pad->rumble_state == RSTATE_UNAVAILABLE)) {
+			pad->rumble_state = RSTATE_INIT;
+			pad->rumble_init_failures = 0;
+		}
 
-	/* Detect when a pack becomes present and schedule initialisation when it happens. */
-	if ((caps[2] & 0x01) && (n64_rumble_state == RSTATE_UNAVAILABLE)) {
-		n64_rumble_state = RSTATE_INIT;
+		/* Detect when a pack is removed. */
+		if (!(caps[2] & 0x01) || (caps[2] & 0x02) ) {
+			pad->rumble_state = RSTATE_UNAVAILABLE;
+		}
 	}
 
-	/* Detect when a pack is removed. */
-	if (!(caps[2] & 0x01) || (caps[2] & 0x02) ) {
-		n64_rumble_state = RSTATE_UNAVAILABLE;
+	cmd[0] = N64_GET_STATUS;
+
+	return 0;
+}
+
+/* Rumble pak writes (35 bytes, ~1.2ms on the wire) are done here, after
+ * the status poll, so they never delay it. At most one write per call
+ * and one every RUMBLE_HOLDOFF calls. Changes requested by the host in
+ * between are coalesced: only the latest state is written.
+ *
+ * Controller pak transfers and transfer pak dumps (see n64pak.c and
+ * tpak.c) come first. */
+static void n64AfterPoll(void)
+{
+	struct n64_pad *pad = &n64_pads[gcn64_getPort()];
+	char on;
+
+	if (n64pak_doTask() || tpak_doTask())
+		return;
+
+	if (pad->rumble_holdoff) {
+		pad->rumble_holdoff--;
+		return;
 	}
+
 #ifdef BUTTON_A_RUMBLE_TEST
-	must_rumble = force_rumble;
+	pad->must_rumble = force_rumble;
 #endif
+	on = pad->must_rumble ? 1 : 0;
 
-	switch (n64_rumble_state)
+	switch (pad->rumble_state)
 	{
-		case RSTATE_INIT:
-			/* Retry until the controller answers with a full byte. */
-			if (initRumble() != 0) {
-				if (initRumble() != 0) {
-					n64_rumble_state = RSTATE_UNAVAILABLE;
-				}
-				break;
-			}
+		case RSTATE_UNAVAILABLE:
+			return;
 
-			if (must_rumble) {
-				controlRumble(1);
-				n64_rumble_state = RSTATE_ON;
-			} else {
-				controlRumble(0);
-				n64_rumble_state = RSTATE_OFF;
+		case RSTATE_INIT:
+			if (0 == initRumble()) {
+				pad->rumble_state = RSTATE_TURNOFF;
+			} else if (++pad->rumble_init_failures >= RUMBLE_INIT_ATTEMPTS) {
+				pad->rumble_state = RSTATE_UNAVAILABLE;
 			}
 			break;
 
-		case RSTATE_TURNON:
-			if (0 == controlRumble(1)) {
-				n64_rumble_state = RSTATE_ON;
-			}
-			break;
+		default:
+			if (pad->rumble_state == (on ? RSTATE_ON : RSTATE_OFF))
+				return; // nothing to write
 
-		case RSTATE_TURNOFF:
-			if (0 == controlRumble(0)) {
-				n64_rumble_state = RSTATE_OFF;
+			if (0 == controlRumble(on)) {
+				pad->rumble_state = on ? RSTATE_ON : RSTATE_OFF;
+			} else {
+				pad->rumble_state = on ? RSTATE_TURNON : RSTATE_TURNOFF;
 			}
 			break;
+	}
 
-		case RSTATE_ON:
-			if (!must_rumble) {
-				 controlRumble(0);
-				 n64_rumble_state = RSTATE_OFF;
-			}
-			break;
+	pad->rumble_holdoff = RUMBLE_HOLDOFF;
+}
 
-		case RSTATE_OFF:
-			if (must_rumble) {
-				 controlRumble(1);
-				n64_rumble_state = RSTATE_ON;
-			}
-			break;
-	}
+/* Where each bit of the status reply goes in the report. Buttons are
+ * remapped as they always were by this adapter. Might change in v3 when
+ * a N64 specific report descriptor will be used.
+ * See gcn64_scatterReply() */
+static const unsigned char n64_status_scatter[] PROGMEM = {
+	// A B Z START
+	GCN64_SCATTER_BIT(7, 0x01), GCN64_SCATTER_BIT(7, 0x02),
+	GCN64_SCATTER_BIT(7, 0x04), GCN64_SCATTER_BIT(7, 0x08),
+	// Up down left right
+	GCN64_SCATTER_BIT(8, 0x04), GCN64_SCATTER_BIT(8, 0x08),
+	GCN64_SCATTER_BIT(8, 0x10), GCN64_SCATTER_BIT(8, 0x20),
+	// unknown, unknown, L R
+	GCN64_SCATTER_NONE, GCN64_SCATTER_NONE,
+	GCN64_SCATTER_BIT(8, 0x01), GCN64_SCATTER_BIT(8, 0x02),
+	// C-UP C-DOWN C-LEFT C-RIGHT
+	GCN64_SCATTER_BIT(7, 0x10), GCN64_SCATTER_BIT(7, 0x20),
+	GCN64_SCATTER_BIT(7, 0x40), GCN64_SCATTER_BIT(7, 0x80),
+	// Raw analog X and Y axes, see n64_stick_lut
+	GCN64_SCATTER_BYTE(1, 0x00),
+	GCN64_SCATTER_BYTE(2, 0x00),
+};
 
-	tmpdata[0] = N64_GET_STATUS;
-	count = gcn64_transaction(tmpdata, 1);
-	if (count != N64_GET_STATUS_REPLY_LENGTH) {
-		return -1;
-	}
+static char n64ParsePoll(void)
+{
+	struct n64_pad *pad = &n64_pads[gcn64_getPort()];
+#ifdef GCN64_16BIT_AXES
+	unsigned char raw[1 + GCN64_NUM_AXES + 2];
+	unsigned char *report = raw;
+	unsigned char i;
+#else
+	unsigned char *report = pad->last_built_report;
+#endif
 
 /*
 	Bit	Function
@@ -213,66 +275,63 @@ static char n64Update(void)
 	24-31: analog Y axis
  */
 
-	btns1 = gcn64_protocol_getByte(0);
-	btns2 = gcn64_protocol_getByte(8);
-	x = gcn64_protocol_getByte(16); // X axis
-	y = gcn64_protocol_getByte(24); // Y axis
+	report[0] = gcn64_getPort() + 1; // report ID
+	report[3] = 0x7f;
+	report[4] = 0x7f;
+	report[5] = 0x7f;
+	report[6] = 0x7f;
+	report[7] = 0;
+	report[8] = 0;
+	gcn64_scatterReply(n64_status_scatter, report, N64_GET_STATUS_REPLY_LENGTH / 8);
 
 #ifdef BUTTON_A_RUMBLE_TEST
-	if (btns1 & 0x80) {
+	if (report[7] & 0x01) {
 		force_rumble = 1;
 	} else {
 		force_rumble = 0;
 	}
 #endif
 
-	// Remap buttons as they always were by this
-	// adapter. Might change in v3 when a N64
-	// specific report descriptor will be used.
-	//
-	rb1 = rb2 = 0;
-	for (i=0; i<4; i++) // A B Z START
-		rb1 |= (btns1 & (0x80 >> i)) ? (0x01<<i) : 0;
-	for (i=0; i<4; i++) // C-UP C-DOWN C-LEFT C-RIGHT
-		rb1 |= btns2 & (0x08 >> i) ? (0x10<<i) : 0;
-	for (i=0; i<2; i++) // L R
-		rb2 |= btns2 & (0x20 >> i) ? (0x01<<i) : 0;
-	for (i=0; i<4; i++) // Up down left right
-		rb2 |= btns1 & (0x08 >> i) ? (0x04<<i) : 0;
-
-	x = (x ^ 0x80) - 1;
-	y = ((y ^ 0x80) ) ^ 0xFF;
-
-	// The following helps a cheap TTX controller
-	// which uses the full 8 bit range instead
-	// of +/- 80. The specific test here prevents
-	// receiving a value of 128 (instead of -127).
-	//
-	// This will have no effect on "normal" controllers.
-	if (x == 0xFF)
-		x = 0;
-
-	// analog joystick
-	last_built_report[0] = 1;
-	last_built_report[1] = x;
-	last_built_report[2] = y;
-
-	last_built_report[3] = 0x7f;
-	last_built_report[4] = 0x7f;
-	last_built_report[5] = 0x7f;
-	last_built_report[6] = 0x7f;
-
-	// buttons
-	last_built_report[7] = rb1;
-	last_built_report[8] = rb2;
+	// Signed +/- 80 to 0x80 +/- 127, with a deadzone (see curves.txt).
+	// Values beyond the table reach, like the full 8 bit range some
+	// cheap TTX controllers use, are clamped. Y is inverted.
+	report[1] = AXIS_LUT(n64_stick_lut, report[1]);
+	report[2] = AXIS_LUT(n64_stick_lut, report[2]) ^ 0xff;
+
+#ifdef GCN64_16BIT_AXES
+	// The N64 stick is not noisy enough to gain from averaging.
+	// Scale to 16 bits (v * 257) and keep the buttons.
+	pad->last_built_report[0] = raw[0];
+	for (i=0; i<GCN64_NUM_AXES; i++) {
+		pad->last_built_report[1 + i*2] = raw[1 + i];
+		pad->last_built_report[2 + i*2] = raw[1 + i];
+	}
+	pad->last_built_report[GCN64_BUTTONS_OFFSET] = raw[7];
+	pad->last_built_report[GCN64_BUTTONS_OFFSET + 1] = raw[8];
+#endif
 
 	return 0;
 }
 
+static char n64Update(void)
+{
+	unsigned char count;
+
+	if (n64BuildPoll(tmpdata))
+		return -1;
+
+	count = gcn64_transactionRetry(tmpdata, 1, N64_GET_STATUS_REPLY_LENGTH);
+	if (count != N64_GET_STATUS_REPLY_LENGTH) {
+		return -1;
+	}
+
+	return n64ParsePoll();
+}
+
 static char n64Probe(void)
 {
+	struct n64_pad *pad = &n64_pads[gcn64_getPort()];
 	int count;
-	char i;
 	unsigned char tmp;
 
 	/* Pad answer to N64_GET_CAPABILITIES
@@ -285,40 +344,39 @@ static char n64Probe(void)
 	 * Bit 1 tells is if there was something connected that has been removed.
 	 */
 
-	n64_rumble_state = RSTATE_UNAVAILABLE;
-
-	for (i=0; i<15; i++)
-	{
-		usbPoll(); // must be called at each 50ms or less
-		_delay_ms(30);
+	pad->rumble_state = RSTATE_UNAVAILABLE;
 
-		tmp = N64_GET_CAPABILITIES;
-		count = gcn64_transaction(&tmp, 1);
+	// A single attempt. Detection (main.c) tries again at the next poll.
+	tmp = N64_GET_CAPABILITIES;
+	count = gcn64_transaction(&tmp, 1, N64_CAPS_REPLY_LENGTH);
 
-		if (count == N64_CAPS_REPLY_LENGTH) {
-			return 1;
-		}
-	}
-	return 0;
+	return count == N64_CAPS_REPLY_LENGTH;
 }
 
 static char n64Changed(int id)
 {
-	return memcmp(last_built_report, last_sent_report, GCN64_REPORT_SIZE);
+	struct n64_pad *pad = &n64_pads[gcn64_getPort()];
+
+	return gcn64_reportChanged(pad->last_built_report, pad->last_sent_report,
+								&pad->quiet_polls);
 }
 
 static int n64BuildReport(unsigned char *reportBuffer, int id)
 {
+	struct n64_pad *pad = &n64_pads[gcn64_getPort()];
+
 	if (reportBuffer)
-		memcpy(reportBuffer, last_built_report, GCN64_REPORT_SIZE);
+		memcpy(reportBuffer, pad->last_built_report, GCN64_REPORT_SIZE);
 
-	memcpy(	last_sent_report, last_built_report, GCN64_REPORT_SIZE);
+	memcpy(	pad->last_sent_report, pad->last_built_report, GCN64_REPORT_SIZE);
 	return GCN64_REPORT_SIZE;
 }
 
 static void n64SetVibration(int value)
 {
-	must_rumble = value;
+	struct n64_pad *pad = &n64_pads[gcn64_getPort()];
+
+	pad->must_rumble = value;
 }
 
 static Gamepad N64Gamepad = {
@@ -329,6 +387,11 @@ static Gamepad N64Gamepad = {
 	.probe					= n64Probe,
 	.num_reports			= 1,
 	.setVibration			= n64SetVibration,
+	.buildPoll				= n64BuildPoll,
+	.parsePoll				= n64ParsePoll,
+	.pollLength				= 1,
+	.pollReplyBits			= N64_GET_STATUS_REPLY_LENGTH,
+	.afterPoll				= n64AfterPoll,
 };
 
 Gamepad *n64GetGamepad(void)
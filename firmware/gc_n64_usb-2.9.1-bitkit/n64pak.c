@@ -0,0 +1,307 @@
+/*	gc_n64_usb : Gamecube or N64 controller to USB firmware
+	Copyright (C) 2007-2014  Raphael Assenat <raph@raphnet.net>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <avr/pgmspace.h>
+#include <string.h>
+
+#include "gcn64_protocol.h"
+#include "n64pak.h"
+
+/* Controller pak backup and restore.
+ *
+ * The pak is read and written 32 bytes at a time with the expansion
+ * commands. The address sent carries a 5 bit CRC in its low bits, and
+ * the controller answers with a CRC of the data (read: after the data,
+ * write: alone). The CRC is inverted when nothing is inserted.
+ *
+ * The host talks to this module with feature report 16h (see main.c).
+ * Transfers to the controller are done from n64AfterPoll(), one per
+ * call, so they never delay polling. A small queue lets the host and
+ * the controller side work at the same time:
+ *
+ *  - Read: after a READ command, blocks are read ahead into the queue.
+ *    Each GET of the report returns the oldest one, making room for the
+ *    next read. A dump costs one control transfer per block.
+ *
+ *  - Write: each SET with the WRITE command queues a block. It is
+ *    refused (STALL) while the queue is full; the host retries. GET
+ *    tells when everything was written, or where it failed.
+ */
+
+#define PAK_QUEUE		2
+#define PAK_RETRIES		3
+
+#define PAK_READING		1
+#define PAK_WRITING		2
+
+static unsigned char pak_mode;
+static unsigned char pak_status = N64PAK_ST_IDLE;
+static unsigned char pak_port;
+static unsigned int pak_next;		// next block to read
+static unsigned int pak_err_addr;
+static unsigned char pak_tries;
+
+static unsigned char pak_data[PAK_QUEUE][N64PAK_BLOCK_SIZE];
+static unsigned int pak_addr[PAK_QUEUE];
+static unsigned char pak_head, pak_count;
+
+/* 5 bit CRC of address bits 15-5, in bits 4-0 */
+static unsigned int pak_addrWithCrc(unsigned int addr)
+{
+	static const unsigned char xor_table[11] PROGMEM = {
+		0x15, 0x1F, 0x0B, 0x16, 0x19, 0x07, 0x0E, 0x1C, 0x0D, 0x1A, 0x01
+	};
+	unsigned char crc = 0, i;
+
+	addr &= 0xffe0;
+	for (i=0; i<11; i++) {
+		if (addr & (0x20u << i))
+			crc ^= pgm_read_byte(&xor_table[i]);
+	}
+
+	return addr | crc;
+}
+
+/* CRC-8 (polynomial 85h) the controller computes over block data */
+static unsigned char pak_dataCrc(const unsigned char *data)
+{
+	unsigned char crc = 0, i, bit, b;
+
+	for (i=0; i<=N64PAK_BLOCK_SIZE; i++) {
+		b = i < N64PAK_BLOCK_SIZE ? data[i] : 0;
+		for (bit=0; bit<8; bit++) {
+			if (crc & 0x80) {
+				crc = ((crc << 1) | (b >> 7)) ^ 0x85;
+			} else {
+				crc = (crc << 1) | (b >> 7);
+			}
+			b <<= 1;
+		}
+	}
+
+	return crc;
+}
+
+static void pak_fail(unsigned char status, unsigned int addr)
+{
+	pak_status = status;
+	pak_err_addr = addr;
+	pak_mode = 0;
+	pak_count = 0;
+}
+
+/* \brief A SET of the pak report, from the host.
+ * \return 0 if accepted, -1 to refuse it (STALL)
+ */
+char n64pak_request(const unsigned char *report, unsigned char len)
+{
+	unsigned int addr;
+	unsigned char slot;
+
+	if (len < 5 || report[2] >= GCN64_NUM_PORTS)
+		return -1;
+
+	addr = (report[3] | (report[4] << 8)) & ~(N64PAK_BLOCK_SIZE - 1);
+	if (addr >= N64PAK_SIZE)
+		return -1;
+
+	switch (report[1])
+	{
+		case N64PAK_CMD_STOP:
+			pak_mode = 0;
+			pak_count = 0;
+			pak_status = N64PAK_ST_IDLE;
+			return 0;
+
+		case N64PAK_CMD_READ:
+			pak_mode = PAK_READING;
+			pak_status = N64PAK_ST_BUSY;
+			pak_port = report[2];
+			pak_next = addr;
+			pak_head = pak_count = 0;
+			pak_tries = 0;
+			return 0;
+
+		case N64PAK_CMD_WRITE:
+			if (len < N64PAK_REPORT_SIZE)
+				return -1;
+			if (pak_mode == PAK_READING || pak_status == N64PAK_ST_ERROR ||
+					pak_status == N64PAK_ST_NO_PAK)
+				return -1;
+			if (pak_mode == PAK_WRITING && (pak_count >= PAK_QUEUE || pak_port != report[2]))
+				return -1;
+
+			if (pak_mode != PAK_WRITING) {
+				pak_mode = PAK_WRITING;
+				pak_port = report[2];
+				pak_head = pak_count = 0;
+				pak_tries = 0;
+			}
+
+			slot = (pak_head + pak_count) % PAK_QUEUE;
+			pak_addr[slot] = addr;
+			memcpy(pak_data[slot], report + 5, N64PAK_BLOCK_SIZE);
+			pak_count++;
+			pak_status = N64PAK_ST_BUSY;
+			return 0;
+	}
+
+	return -1;
+}
+
+/* \brief A GET of the pak report, from the host.
+ * \return The report length
+ */
+unsigned char n64pak_getReport(unsigned char *report)
+{
+	unsigned int addr = pak_err_addr;
+
+	report[1] = pak_status;
+	report[2] = pak_port;
+	memset(report + 5, 0, N64PAK_BLOCK_SIZE);
+
+	if (pak_mode == PAK_READING) {
+		if (pak_count) {
+			addr = pak_addr[pak_head];
+			memcpy(report + 5, pak_data[pak_head], N64PAK_BLOCK_SIZE);
+			report[1] = N64PAK_ST_DATA;
+
+			pak_head = (pak_head + 1) % PAK_QUEUE;
+			pak_count--;
+
+			// Last block handed over
+			if (!pak_count && pak_next >= N64PAK_SIZE) {
+				pak_mode = 0;
+				pak_status = N64PAK_ST_IDLE;
+			}
+		} else {
+			addr = pak_next;
+		}
+	} else if (pak_mode == PAK_WRITING && pak_count) {
+		addr = pak_addr[pak_head];
+	}
+
+	report[3] = addr;
+	report[4] = addr >> 8;
+
+	return N64PAK_REPORT_SIZE;
+}
+
+/* \brief Read a 32 byte block from the pak.
+ * \return 0 on success, 1 if no pak is inserted, -1 on error
+ */
+char n64pak_readBlock(unsigned int addr, unsigned char *dst)
+{
+	unsigned char cmd[3];
+	unsigned int a = pak_addrWithCrc(addr);
+	unsigned char crc;
+
+	cmd[0] = N64_EXPANSION_READ;
+	cmd[1] = a >> 8;
+	cmd[2] = a;
+	if (gcn64_transaction(cmd, 3, N64_EXPANSION_READ_REPLY_LENGTH) != N64_EXPANSION_READ_REPLY_LENGTH)
+		return -1;
+
+	gcn64_protocol_getBytes(0, N64PAK_BLOCK_SIZE, dst);
+	crc = gcn64_protocol_getByte(N64PAK_BLOCK_SIZE * 8);
+
+	crc ^= pak_dataCrc(dst);
+	if (crc == 0)
+		return 0;
+	if (crc == 0xff)
+		return 1; // no pak
+
+	return -1;
+}
+
+/* \brief Write a 32 byte block to the pak.
+ * \return 0 on success, 1 if no pak is inserted, -1 on error
+ */
+char n64pak_writeBlock(unsigned int addr, const unsigned char *src)
+{
+	unsigned char cmd[3 + N64PAK_BLOCK_SIZE];
+	unsigned int a = pak_addrWithCrc(addr);
+	unsigned char crc;
+
+	cmd[0] = N64_EXPANSION_WRITE;
+	cmd[1] = a >> 8;
+	cmd[2] = a;
+	memcpy(cmd + 3, src, N64PAK_BLOCK_SIZE);
+	if (gcn64_transaction(cmd, sizeof(cmd), N64_EXPANSION_WRITE_REPLY_LENGTH) != N64_EXPANSION_WRITE_REPLY_LENGTH)
+		return -1;
+
+	crc = gcn64_protocol_getByte(0);
+
+	crc ^= pak_dataCrc(src);
+	if (crc == 0)
+		return 0;
+	if (crc == 0xff)
+		return 1; // no pak
+
+	return -1;
+}
+
+/* \brief One pak transaction, if one is due on the current port.
+ * Called from n64AfterPoll().
+ * \return Non-zero if the bus was used
+ */
+char n64pak_doTask(void)
+{
+	unsigned char slot;
+	unsigned int addr;
+	char res;
+
+	if (!pak_mode || gcn64_getPort() != pak_port)
+		return 0;
+
+	if (pak_mode == PAK_READING) {
+		if (pak_count >= PAK_QUEUE || pak_next >= N64PAK_SIZE)
+			return 0;
+
+		slot = (pak_head + pak_count) % PAK_QUEUE;
+		addr = pak_next;
+		res = n64pak_readBlock(addr, pak_data[slot]);
+		if (res == 0) {
+			pak_addr[slot] = addr;
+			pak_count++;
+			pak_next += N64PAK_BLOCK_SIZE;
+			pak_tries = 0;
+			return 1;
+		}
+	} else {
+		if (!pak_count)
+			return 0;
+
+		addr = pak_addr[pak_head];
+		res = n64pak_writeBlock(addr, pak_data[pak_head]);
+		if (res == 0) {
+			pak_head = (pak_head + 1) % PAK_QUEUE;
+			pak_count--;
+			if (!pak_count)
+				pak_status = N64PAK_ST_IDLE;
+			pak_tries = 0;
+			return 1;
+		}
+	}
+
+	if (res > 0) {
+		pak_fail(N64PAK_ST_NO_PAK, addr);
+	} else if (++pak_tries > PAK_RETRIES) {
+		pak_fail(N64PAK_ST_ERROR, addr);
+	}
+
+	return 1;
+}
@@ -0,0 +1,33 @@
+#ifndef _n64pak_h__
+#define _n64pak_h__
+
+/* N64 controller pak (memory card) transfers, driven by the host through
+ * vendor feature report 16h. See n64pak.c */
+
+#define N64PAK_SIZE			0x8000
+#define N64PAK_BLOCK_SIZE	32
+
+/* Byte 1 of the report, written by the host */
+#define N64PAK_CMD_STOP		0	// abort, back to idle
+#define N64PAK_CMD_READ		1	// stream blocks from the address to the end
+#define N64PAK_CMD_WRITE	2	// write the block at the address
+
+/* Byte 1 of the report, read by the host */
+#define N64PAK_ST_IDLE		0	// nothing in progress, all writes done
+#define N64PAK_ST_BUSY		1	// no block read yet, or writes pending
+#define N64PAK_ST_DATA		2	// the block at the address follows
+#define N64PAK_ST_ERROR		3	// failed at the address. Send STOP to clear.
+#define N64PAK_ST_NO_PAK	4	// the controller says nothing is inserted
+
+/* ID, command/status, port, address (little endian), data */
+#define N64PAK_REPORT_SIZE	(5 + N64PAK_BLOCK_SIZE)
+
+char n64pak_request(const unsigned char *report, unsigned char len);
+unsigned char n64pak_getReport(unsigned char *report);
+char n64pak_doTask(void);
+
+/* Block access, also used by the transfer pak (see tpak.c) */
+char n64pak_readBlock(unsigned int addr, unsigned char *dst);
+char n64pak_writeBlock(unsigned int addr, const unsigned char *src);
+
+#endif // _n64pak_h__
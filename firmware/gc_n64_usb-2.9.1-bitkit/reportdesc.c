@@ -24,7 +24,24 @@
  * axis types and button quantity.
  */
 
+#include <string.h>
+
 #include "reportdesc.h"
+#include "gcn64_protocol.h"
+#include "config.h"
+#include "n64pak.h"
+#include "tpak.h"
+
+/* Axis items for the joystick collections. See GCN64_16BIT_AXES */
+#ifdef GCN64_16BIT_AXES
+#define AXIS_REPORT_SIZE	0x75,0x10
+#define AXIS_LOGICAL_MAX	0x27,0xFF,0xFF,0x00,0x00
+#define AXIS_PHYSICAL_MAX	0x47,0xFF,0xFF,0x00,0x00
+#else
+#define AXIS_REPORT_SIZE	0x75,0x08
+#define AXIS_LOGICAL_MAX	0x26,0xFF,0x00
+#define AXIS_PHYSICAL_MAX	0x46,0xFF,0x00
+#endif
 
 const char gcn64_usbHidReportDescriptor[] PROGMEM = {
 ///// gampad
@@ -39,12 +56,12 @@ const char gcn64_usbHidReportDescriptor[] PROGMEM = {
 	0x09, 0x01,                    //     usage pointer
 	0xA1, 0x00,	 				   // COLLECTION (phys)
 		 0x05, 0x01, // USAGE_PAGE (Generic desktop)
-		0x75, 0x08,                    //     REPORT_SIZE (8)
+		AXIS_REPORT_SIZE,              //     REPORT_SIZE (8 or 16)
 		0x95, 0x06,                    //     REPORT_COUNT (6)
 		0x15, 0x00,                    //     LOGICAL_MINIMUM (0)
-		0x26, 0xFF, 0x00,              //     LOGICAL_MAXIMUM (255)
+		AXIS_LOGICAL_MAX,              //     LOGICAL_MAXIMUM (255 or 65535)
 		0x35, 0x00,                    //     Physical Minimum (0)
-		0x46, 0xFF, 0x00,              //     Physical Minimum (255)
+		AXIS_PHYSICAL_MAX,             //     Physical Minimum (255 or 65535)
 		0x09, 0x30,                    //     USAGE (X)
 		0x09, 0x31,                    //     USAGE (Y)
 		0x09, 0x33,					   //     USAGE (Rx)
@@ -647,6 +664,51 @@ const char gcn64_usbHidReportDescriptor[] PROGMEM = {
    0x95,0x01,                   //    Report Count 1
    0xB1,0x03,                   //    Feature (Constant, Variable)
    0xC0,    //    End Collection
+
+// Vendor defined feature reports. See main.c
+0x06,0x00,0xFF,    //    Usage Page Vendor Defined FF00h
+0x09,0x01,         //    Usage 1 (Decoder timing profile)
+0xA1,0x02,         //    Collection Logical
+   0x85,0x10,         //    Report ID 10h (16d)
+   0x09,0x01,         //    Usage 1
+   0x15,0x00,         //    Logical Minimum 0
+   0x26,0xFF,0x00,    //    Logical Maximum FFh (255d)
+   0x35,0x00,         //    Physical Minimum 0
+   0x46,0xFF,0x00,    //    Physical Maximum FFh (255d)
+   0x75,0x08,         //    Report Size 8
+   0x95,0x07,         //    Report Count 7
+   0xB1,0x02,         //    Feature (Variable)
+   0x85,0x11,         //    Report ID 11h (17d)
+   0x09,0x02,         //    Usage 2 (Bus statistics)
+   0x27,0xFF,0xFF,0x00,0x00,    //    Logical Maximum FFFFh (65535d)
+   0x47,0xFF,0xFF,0x00,0x00,    //    Physical Maximum FFFFh (65535d)
+   0x75,0x10,         //    Report Size 10h (16d)
+   0x95,GCN64_STATS_VALUES,     //    Report Count
+   0xB1,0x02,         //    Feature (Variable)
+   0x85,0x13,         //    Report ID 13h (19d)
+   0x09,0x04,         //    Usage 4 (Sample age and mailbox counters)
+   0x95,0x05,         //    Report Count 5
+   0xB1,0x02,         //    Feature (Variable)
+   0x85,0x14,         //    Report ID 14h (20d)
+   0x09,0x05,         //    Usage 5 (Poll rate, bInterval, max poll rate)
+   0x95,0x03,         //    Report Count 3
+   0xB1,0x02,         //    Feature (Variable)
+   0x85,0x15,         //    Report ID 15h (21d)
+   0x09,0x06,         //    Usage 6 (Axis change threshold)
+   0x26,0xFF,0x00,    //    Logical Maximum FFh (255d)
+   0x46,0xFF,0x00,    //    Physical Maximum FFh (255d)
+   0x75,0x08,         //    Report Size 8
+   0x95,0x01,         //    Report Count 1
+   0xB1,0x02,         //    Feature (Variable)
+   0x85,0x16,         //    Report ID 16h (22d)
+   0x09,0x07,         //    Usage 7 (Controller pak block transfer)
+   0x95,N64PAK_REPORT_SIZE-1,   //    Report Count
+   0xB1,0x02,         //    Feature (Variable)
+   0x85,0x17,         //    Report ID 17h (23d)
+   0x09,0x08,         //    Usage 8 (Transfer pak cartridge dump)
+   0x95,TPAK_REPORT_SIZE-1,   //    Report Count
+   0xB1,0x02,         //    Feature (Variable)
+0xC0,    //    End Collection
 0xC0,    //    End Collection
 
 
@@ -657,3 +719,165 @@ int getUsbHidReportDescriptor_size(void)
 	return sizeof(gcn64_usbHidReportDescriptor);
 }
 
+#if GCN64_NUM_PORTS > 1
+/* One joystick per port, each with its own report ID (port + 1) and the
+ * same layout as report 1 above. There is no room for the PID (force
+ * feedback) reports here as they use IDs 1 to 14. Rumble is a plain
+ * output report instead. */
+#define JOYSTICK_COLLECTION(id) \
+0x05,0x01,                    /* Usage Page Generic Desktop */ \
+0x09,0x05,                    /* Usage Game Pad */ \
+0xA1,0x01,                    /* Collection Application */ \
+   0x85,(id),                 /*    Report ID */ \
+   0x09,0x01,                 /*    Usage Pointer */ \
+   0xA1,0x00,                 /*    Collection Physical */ \
+      AXIS_REPORT_SIZE,       /*       Report Size 8 or 16 */ \
+      0x95,0x06,              /*       Report Count 6 */ \
+      0x15,0x00,              /*       Logical Minimum 0 */ \
+      AXIS_LOGICAL_MAX,       /*       Logical Maximum */ \
+      0x35,0x00,              /*       Physical Minimum 0 */ \
+      AXIS_PHYSICAL_MAX,      /*       Physical Maximum */ \
+      0x09,0x30,              /*       Usage X */ \
+      0x09,0x31,              /*       Usage Y */ \
+      0x09,0x33,              /*       Usage Rx */ \
+      0x09,0x34,              /*       Usage Ry */ \
+      0x09,0x35,              /*       Usage Rz */ \
+      0x09,0x36,              /*       Usage Slider */ \
+      0x81,0x02,              /*       Input (Variable) */ \
+      0x05,0x09,              /*       Usage Page Button */ \
+      0x25,0x01,              /*       Logical Maximum 1 */ \
+      0x45,0x01,              /*       Physical Maximum 1 */ \
+      0x19,0x01,              /*       Usage Minimum (Button 1) */ \
+      0x29,NUM_BUTTONS,       /*       Usage Maximum */ \
+      0x75,0x01,              /*       Report Size 1 */ \
+      0x95,NUM_BUTTONS,       /*       Report Count */ \
+      0x81,0x02,              /*       Input (Variable) */ \
+   0xC0,                      /*    End Collection */ \
+0xC0,                         /* End Collection */
+
+const char gcn64_multiUsbHidReportDescriptor[] PROGMEM = {
+JOYSTICK_COLLECTION(1)
+JOYSTICK_COLLECTION(2)
+#if GCN64_NUM_PORTS > 2
+JOYSTICK_COLLECTION(3)
+#endif
+#if GCN64_NUM_PORTS > 3
+JOYSTICK_COLLECTION(4)
+#endif
+
+// Vendor defined reports. See main.c
+0x06,0x00,0xFF,    //    Usage Page Vendor Defined FF00h
+0x09,0x01,         //    Usage 1
+0xA1,0x01,         //    Collection Application
+   0x15,0x00,         //    Logical Minimum 0
+   0x26,0xFF,0x00,    //    Logical Maximum FFh (255d)
+   0x35,0x00,         //    Physical Minimum 0
+   0x46,0xFF,0x00,    //    Physical Maximum FFh (255d)
+   0x75,0x08,         //    Report Size 8
+   0x85,0x10,         //    Report ID 10h (16d)
+   0x09,0x01,         //    Usage 1 (Decoder timing profile, for each port)
+   0x95,7*GCN64_NUM_PORTS,  //    Report Count
+   0xB1,0x02,         //    Feature (Variable)
+   0x85,0x12,         //    Report ID 12h (18d)
+   0x09,0x03,         //    Usage 3 (Rumble, one bit per port)
+   0x95,0x01,         //    Report Count 1
+   0x91,0x02,         //    Output (Variable)
+   0x85,0x11,         //    Report ID 11h (17d)
+   0x09,0x02,         //    Usage 2 (Bus statistics)
+   0x27,0xFF,0xFF,0x00,0x00,    //    Logical Maximum FFFFh (65535d)
+   0x47,0xFF,0xFF,0x00,0x00,    //    Physical Maximum FFFFh (65535d)
+   0x75,0x10,         //    Report Size 10h (16d)
+   0x95,GCN64_STATS_VALUES,     //    Report Count
+   0xB1,0x02,         //    Feature (Variable)
+   0x85,0x13,         //    Report ID 13h (19d)
+   0x09,0x04,         //    Usage 4 (Sample age and mailbox counters)
+   0x95,0x05,         //    Report Count 5
+   0xB1,0x02,         //    Feature (Variable)
+   0x85,0x14,         //    Report ID 14h (20d)
+   0x09,0x05,         //    Usage 5 (Poll rate, bInterval, max poll rate)
+   0x95,0x03,         //    Report Count 3
+   0xB1,0x02,         //    Feature (Variable)
+   0x85,0x15,         //    Report ID 15h (21d)
+   0x09,0x06,         //    Usage 6 (Axis change threshold)
+   0x26,0xFF,0x00,    //    Logical Maximum FFh (255d)
+   0x46,0xFF,0x00,    //    Physical Maximum FFh (255d)
+   0x75,0x08,         //    Report Size 8
+   0x95,0x01,         //    Report Count 1
+   0xB1,0x02,         //    Feature (Variable)
+   0x85,0x16,         //    Report ID 16h (22d)
+   0x09,0x07,         //    Usage 7 (Controller pak block transfer)
+   0x95,N64PAK_REPORT_SIZE-1,   //    Report Count
+   0xB1,0x02,         //    Feature (Variable)
+   0x85,0x17,         //    Report ID 17h (23d)
+   0x09,0x08,         //    Usage 8 (Transfer pak cartridge dump)
+   0x95,TPAK_REPORT_SIZE-1,   //    Report Count
+   0xB1,0x02,         //    Feature (Variable)
+0xC0,    //    End Collection
+};
+
+int getMultiUsbHidReportDescriptor_size(void)
+{
+	return sizeof(gcn64_multiUsbHidReportDescriptor);
+}
+#endif
+
+
+#ifdef GCN64_16BIT_AXES
+#define AXIS_STEP	257		// One 8-bit step
+#define AXIS_VALUE(r, i)	((r)[1 + (i)*2] | ((r)[2 + (i)*2] << 8))
+#else
+#define AXIS_STEP	1
+#define AXIS_VALUE(r, i)	((r)[1 + (i)])
+#endif
+
+/* Polls without a report after which any axis difference is sent */
+#define GCN64_SETTLE_POLLS	8
+
+/* \brief Tell if a joystick report is worth sending. Call once per poll.
+ *
+ * Any button change counts. An axis only counts when it is more than the
+ * threshold (config_getHysteresis) away from the value last sent, so a
+ * stick flickering between two values does not cause a report at each
+ * poll. Smaller differences are still sent once GCN64_SETTLE_POLLS polls
+ * went by without a report, so a stick coming to rest within the
+ * threshold ends up reported where it is. A flickering value then
+ * causes one report per GCN64_SETTLE_POLLS polls at most.
+ *
+ * \param built The latest report
+ * \param sent The report last sent
+ * \param quiet_polls Per pad count of polls since the last report
+ * \return Non-zero if the report should be sent
+ */
+char gcn64_reportChanged(const unsigned char *built, const unsigned char *sent,
+						unsigned char *quiet_polls)
+{
+	unsigned int threshold = config_getHysteresis() * AXIS_STEP;
+	unsigned int a, b, d;
+	unsigned char i, moved = 0, differs = 0;
+
+	if (memcmp(built + GCN64_BUTTONS_OFFSET, sent + GCN64_BUTTONS_OFFSET, 2))
+		moved = 1;
+
+	for (i=0; i<GCN64_NUM_AXES && !moved; i++) {
+		a = AXIS_VALUE(built, i);
+		b = AXIS_VALUE(sent, i);
+		d = a > b ? a - b : b - a;
+
+		if (d > threshold)
+			moved = 1;
+		if (d)
+			differs = 1;
+	}
+
+	if (!moved) {
+		if (*quiet_polls < GCN64_SETTLE_POLLS) {
+			(*quiet_polls)++;
+			return 0;
+		}
+		if (!differs)
+			return 0;
+	}
+
+	*quiet_polls = 0;
+	return 1;
+}
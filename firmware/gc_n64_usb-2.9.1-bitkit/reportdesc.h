@@ -3,10 +3,30 @@
 
 #include <avr/pgmspace.h>
 
-#define GCN64_REPORT_SIZE	9
+/* Report axes with 16 bits instead of 8. Gamecube sticks and triggers
+ * are then averaged over the last few polls (see gamecube.c) which
+ * gives more resolution and a lot less jitter. */
+#undef GCN64_16BIT_AXES
+
+#define GCN64_NUM_AXES		6
+#ifdef GCN64_16BIT_AXES
+#define GCN64_AXIS_SIZE		2
+#else
+#define GCN64_AXIS_SIZE		1
+#endif
+
+/* Report layout: ID, axes (little endian), then 16 buttons */
+#define GCN64_BUTTONS_OFFSET	(1 + GCN64_NUM_AXES * GCN64_AXIS_SIZE)
+#define GCN64_REPORT_SIZE	(GCN64_BUTTONS_OFFSET + 2)
 
 extern const char gcn64_usbHidReportDescriptor[] PROGMEM;
 int getUsbHidReportDescriptor_size(void);
 
+extern const char gcn64_multiUsbHidReportDescriptor[] PROGMEM;
+int getMultiUsbHidReportDescriptor_size(void);
+
+char gcn64_reportChanged(const unsigned char *built, const unsigned char *sent,
+						unsigned char *quiet_polls);
+
 #endif // _reportdesc_h__
 
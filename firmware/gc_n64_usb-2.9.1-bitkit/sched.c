@@ -0,0 +1,250 @@
+/*	gc_n64_usb : Gamecube or N64 controller to USB firmware
+	Copyright (C) 2007-2014  Raphael Assenat <raph@raphnet.net>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <avr/io.h>
+#include <avr/wdt.h>
+
+#include "usbdrv.h"
+#include "sched.h"
+
+/* Scheduling of the timing sensitive Gamecube/N64 communication
+ * between USB interrupts.
+ *
+ * V-USB services the bus from an interrupt which can take up to 100uS.
+ * When it occurs during a transaction with the controller, the transaction
+ * is corrupted. The interrupt comes from D+ (INT0) on this board, which does
+ * not see SOF/keep-alive (see usbdrv.h), so USB_COUNT_SOF cannot be used to
+ * find the frame boundaries. Instead, Timer1 (running at the CPU clock) is
+ * watched until the next USB interrupt (the only enabled interrupt) steals
+ * cycles, which starts a burst (token, data, handshake), then until no
+ * interrupt has stolen cycles for QUIET_TIME. The controller is polled at
+ * that point, at a fixed offset from host activity.
+ *
+ * The host polls the interrupt-in endpoints every bInterval. That period
+ * is measured between bursts in which the host took the data of an
+ * endpoint, always the same one. Other bursts are not at a fixed rate:
+ * control transfers (feature reports, PID effects), or the other endpoint
+ * (keyboard interface), which the host polls at a phase of its own. Both
+ * come much closer together than the period.
+ *
+ * The time left before the next poll of the host is counted from the last
+ * burst which was not a control transfer (see sched_timeLeft). When the
+ * previous slot would not fit in it, one more burst is waited for.
+ *
+ * All times are in CPU cycles.
+ */
+
+#define CYCLES_PER_US	(F_CPU / 1000000L)
+
+/* The wait loops read the timer much more often than this. A longer
+ * interval between two reads means an interrupt was serviced. */
+#define IRQ_GAP			(10 * CYCLES_PER_US)
+
+/* Time without interrupts after which a burst is considered over. A
+ * handshake follows a data packet within a few uS. */
+#define QUIET_TIME		(30 * CYCLES_PER_US)
+
+/* The period is the shortest interval seen over this many bursts. */
+#define PERIOD_WINDOW	32
+
+/* From usbdrv.c. Only declared in usbdrv.h when flow control is enabled. */
+extern volatile schar usbRxLen;
+extern volatile uchar usbTxLen;
+
+#ifdef TIFR1
+#define TIMER1_FLAGS	TIFR1
+#else
+#define TIMER1_FLAGS	TIFR
+#endif
+
+#if USB_CFG_HAVE_INTRIN_ENDPOINT3
+#define SCHED_ENDPOINTS	2
+#else
+#define SCHED_ENDPOINTS	1
+#endif
+
+static unsigned int t_hi;
+static unsigned long anchor, slot_start, slot_duration;
+static unsigned long period, period_min;
+static unsigned char period_count;
+static unsigned long taken_at[SCHED_ENDPOINTS];
+static unsigned char taken_valid;	// bit 0 for endpoint 1, bit 1 for 3
+static unsigned int collisions;
+static unsigned char intr_was_ready;
+static schar rxlen_before;
+
+/* Timer1 extended to 32 bits. Overflows are only seen if this is
+ * called at least every 65536 cycles (5.4ms at 12MHz). The wait for a
+ * burst calls it constantly, and the main loop at each iteration. */
+unsigned long sched_now(void)
+{
+	unsigned int t = TCNT1;
+
+	if (TIMER1_FLAGS & (1<<TOV1)) {
+		TIMER1_FLAGS = 1<<TOV1;
+		t = TCNT1;
+		t_hi++;
+	}
+
+	return ((unsigned long)t_hi << 16) | t;
+}
+
+/* Wait until the next USB interrupt, then until the burst is over.
+ *
+ * The CPU does not sleep: Timer1 would overflow several times, unseen,
+ * when the host polls every few tens of milliseconds.
+ *
+ * \return The time the burst started. */
+static unsigned long waitBurst(void)
+{
+	unsigned long start, now, prev;
+	unsigned long quiet_start;
+
+	prev = sched_now();
+	for (;;) {
+		now = sched_now();
+		if (now - prev > IRQ_GAP)
+			break;
+		prev = now;
+		wdt_reset();
+	}
+
+	start = prev;
+
+	quiet_start = now;
+	do {
+		prev = now;
+		now = sched_now();
+		if (now - prev > IRQ_GAP) {
+			// Serviced another one. Start over.
+			quiet_start = now;
+		}
+	} while (now - quiet_start < QUIET_TIME);
+
+	return start;
+}
+
+/* Account for a burst in which the host took the data of endpoint ep */
+static void measurePeriod(unsigned char ep, unsigned long burst)
+{
+	unsigned long interval = burst - taken_at[ep];
+
+	taken_at[ep] = burst;
+	if (!(taken_valid & (1<<ep))) {
+		taken_valid |= 1<<ep;
+		return;
+	}
+
+	// When no report was ready for some polls, this is a multiple of
+	// the period. The shortest interval of the window is kept.
+	if (!period_count || interval < period_min)
+		period_min = interval;
+
+	if (++period_count >= PERIOD_WINDOW) {
+		period = period_min;
+		period_count = 0;
+	}
+}
+
+/* Wait for a burst, and learn from what happened in it */
+static void nextBurst(void)
+{
+	unsigned char ready1 = usbInterruptIsReady();
+#if USB_CFG_HAVE_INTRIN_ENDPOINT3
+	unsigned char ready3 = usbInterruptIsReady3();
+#endif
+	schar rxlen = usbRxLen;
+	uchar txlen = usbTxLen;
+	unsigned long burst;
+
+	burst = waitBurst();
+
+	// A SETUP/OUT packet arrived or control data was sent: not at
+	// the polling rate, and not in phase with it.
+	if (usbRxLen != rxlen || usbTxLen != txlen)
+		return;
+
+	anchor = burst;
+
+	if (!ready1 && usbInterruptIsReady()) {
+		measurePeriod(0, burst);
+	}
+#if USB_CFG_HAVE_INTRIN_ENDPOINT3
+	else if (!ready3 && usbInterruptIsReady3()) {
+		measurePeriod(1, burst);
+	}
+#endif
+}
+
+/* Time left before the next expected USB interrupt. Returns 0xffffffff
+ * when the interval between interrupts is not known yet.
+ *
+ * The host polls at a fixed rate. When the last burst seen is more than
+ * a period ago (polls were not waited for, or control transfers came
+ * instead), the next poll is predicted from it. */
+unsigned long sched_timeLeft(void)
+{
+	unsigned long elapsed;
+
+	if (!period)
+		return 0xffffffff;
+
+	elapsed = sched_now() - anchor;
+	while (elapsed >= period) {
+		anchor += period;
+		elapsed -= period;
+	}
+
+	return period - elapsed;
+}
+
+unsigned long sched_getPeriod(void)
+{
+	return period;
+}
+
+/* Count of controller polls during which USB activity was observed. */
+unsigned int sched_getCollisions(void)
+{
+	return collisions;
+}
+
+/* Wait for a safe moment to talk to the controller. */
+void sched_waitSlot(void)
+{
+	nextBurst();
+
+	// If the last slot would not fit before the next burst, wait for it.
+	if (sched_timeLeft() < slot_duration) {
+		nextBurst();
+	}
+
+	intr_was_ready = usbInterruptIsReady();
+	rxlen_before = usbRxLen;
+	slot_start = sched_now();
+}
+
+/* Call when done talking to the controller. */
+void sched_endSlot(void)
+{
+	slot_duration = sched_now() - slot_start;
+
+	// The interrupt endpoint data was taken by the host, or
+	// a SETUP/OUT packet was received during the slot.
+	if ((!intr_was_ready && usbInterruptIsReady()) || (usbRxLen != rxlen_before)) {
+		collisions++;
+	}
+}
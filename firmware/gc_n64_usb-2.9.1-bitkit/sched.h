@@ -0,0 +1,11 @@
+#ifndef _sched_h__
+#define _sched_h__
+
+void sched_waitSlot(void);
+void sched_endSlot(void);
+unsigned long sched_now(void);
+unsigned long sched_timeLeft(void);
+unsigned long sched_getPeriod(void);
+unsigned int sched_getCollisions(void);
+
+#endif // _sched_h__
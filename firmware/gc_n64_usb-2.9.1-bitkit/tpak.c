@@ -0,0 +1,565 @@
+/*	gc_n64_usb : Gamecube or N64 controller to USB firmware
+	Copyright (C) 2007-2014  Raphael Assenat <raph@raphnet.net>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+
+#include "gcn64_protocol.h"
+#include "sched.h"
+#include "n64pak.h"
+#include "tpak.h"
+
+/* Game Boy cartridge dumps through a transfer pak.
+ *
+ * The transfer pak is accessed like a controller pak (see n64pak.c), 32
+ * bytes at a time. Writing 84h at 8000h powers it on, 01h at B000h enables
+ * cartridge access and B000h reads back the status. C000h-FFFFh is a 16kB
+ * window into the cartridge address space, selected by the value written
+ * at A000h. Cartridge ROM and RAM banks are selected by writing to the
+ * memory bank controller (MBC) registers through that window, like a Game
+ * Boy would.
+ *
+ * The host sends a ROM or RAM command with feature report 17h. Work is
+ * done from n64AfterPoll(): after the status poll, reads are issued back
+ * to back as long as they fit before the next USB interrupt, into one of
+ * two chunks of TPAK_CHUNK_BLOCKS blocks. A GET of the report returns the
+ * oldest full chunk, sent from where it was read (no copy). It becomes
+ * free again at the next GET, since the previous control transfer is over
+ * by then. While the host reads one chunk, the other is being filled.
+ *
+ * The host asks again at the expected offset if a chunk went missing.
+ */
+
+/* Transfer pak registers, in the controller pak address space */
+#define TPAK_POWER_ADDR		0x8000
+#define TPAK_BANK_ADDR		0xA000
+#define TPAK_STATUS_ADDR	0xB000
+#define TPAK_WINDOW_ADDR	0xC000
+
+#define TPAK_POWER_ON		0x84
+#define TPAK_POWER_OFF		0xFE
+#define TPAK_ACCESS_ON		0x01
+
+#define TPAK_STATUS_READY	0x01
+#define TPAK_STATUS_REMOVED	0x40
+
+/* Status reads (~polls) to wait for the cartridge after power on */
+#define TPAK_READY_ATTEMPTS	50
+#define TPAK_RETRIES		3
+
+/* A 35 byte write or a 32 byte read, with some margin */
+#define TPAK_STEP_CYCLES	(1500L * (F_CPU / 1000000L))
+
+#if 512 % (TPAK_CHUNK_BLOCKS * 32)
+#error TPAK_CHUNK_BLOCKS must divide 16
+#endif
+
+/* Memory bank controllers */
+#define MBC_NONE	0
+#define MBC_1		1
+#define MBC_2		2
+#define MBC_3		3
+#define MBC_5		5
+
+/* Steps */
+#define TP_IDLE		0
+#define TP_POWER	1
+#define TP_CHECK	2
+#define TP_ACCESS	3
+#define TP_STATUS	4
+#define TP_HEADER	5
+#define TP_DUMP		6
+#define TP_FINISH	7
+
+/* Chunk states */
+#define CHUNK_FREE	0	// being filled
+#define CHUNK_READY	1
+#define CHUNK_SENT	2	// given to the USB driver. Free at the next GET.
+
+static unsigned char tp_step;
+static unsigned char tp_status = TPAK_ST_IDLE;
+static unsigned char tp_target;
+static unsigned char tp_port;
+static unsigned long tp_offset;		// next block to read
+static unsigned long tp_err_offset;
+static unsigned long tp_size;
+static unsigned char tp_tries, tp_attempts;
+static unsigned int tp_retries;
+
+static unsigned char tp_header[3];	// cartridge type, ROM and RAM size codes
+static unsigned char tp_mbc;
+static unsigned char tp_ram_enabled;
+static unsigned int tp_bank;		// selected ROM or RAM bank
+static unsigned int tp_base;		// where it appears in the cartridge space
+static unsigned char tp_window;		// transfer pak bank register
+
+/* MBC register writes to do before the next read */
+#define MAX_WRITES	3
+static unsigned int tp_write_addr[MAX_WRITES];
+static unsigned char tp_write_val[MAX_WRITES];
+static unsigned char tp_writes, tp_write_next;
+
+static unsigned char tp_chunk[2][TPAK_REPORT_SIZE];
+static unsigned char tp_chunk_state[2];
+static unsigned char tp_fill, tp_fill_blocks;
+
+static void tpak_dropChunks(void)
+{
+	unsigned char i;
+
+	// A chunk already sent stays untouched until the next GET
+	for (i=0; i<2; i++) {
+		if (tp_chunk_state[i] == CHUNK_READY)
+			tp_chunk_state[i] = CHUNK_FREE;
+	}
+	tp_fill_blocks = 0;
+}
+
+static void tpak_fail(unsigned char status)
+{
+	tp_status = status;
+	tp_err_offset = tp_offset;
+	tp_writes = tp_write_next = 0;
+	tpak_dropChunks();
+
+	// Power it off, unless it is not a transfer pak or that is what failed.
+	if (status == TPAK_ST_NO_TPAK || tp_step == TP_FINISH) {
+		tp_step = TP_IDLE;
+	} else {
+		tp_step = TP_FINISH;
+	}
+}
+
+static unsigned char tpak_mbcType(unsigned char type)
+{
+	if (type == 0x00 || type == 0x08 || type == 0x09)
+		return MBC_NONE;
+	if (type >= 0x01 && type <= 0x03)
+		return MBC_1;
+	if (type == 0x05 || type == 0x06)
+		return MBC_2;
+	if (type >= 0x0f && type <= 0x13)
+		return MBC_3;
+
+	// MBC5, and others (camera, ...) which bank ROM the same way
+	return MBC_5;
+}
+
+static unsigned long tpak_ramSize(void)
+{
+	switch (tp_header[2])
+	{
+		case 1: return 0x800;
+		case 2: return 0x2000;
+		case 3: return 0x8000;
+		case 4: return 0x20000;
+		case 5: return 0x10000;
+	}
+
+	// MBC2 has 512 x 4 bits built in
+	return tp_mbc == MBC_2 ? 0x200 : 0;
+}
+
+static void tpak_queueWrite(unsigned int addr, unsigned char value)
+{
+	if (tp_write_next >= tp_writes)
+		tp_writes = tp_write_next = 0;
+
+	tp_write_addr[tp_writes] = addr;
+	tp_write_val[tp_writes] = value;
+	tp_writes++;
+}
+
+/* Queue the MBC writes selecting a bank, and note where it appears */
+static void tpak_selectBank(unsigned int bank)
+{
+	tp_writes = tp_write_next = 0;
+	tp_bank = bank;
+
+	if (tp_target == TPAK_CMD_RAM) {
+		tp_base = 0xA000;
+		switch (tp_mbc)
+		{
+			case MBC_1:
+				tpak_queueWrite(0x6000, 1); // RAM banking mode
+				// fall through
+			case MBC_3:
+			case MBC_5:
+				tpak_queueWrite(0x4000, bank);
+				break;
+		}
+		return;
+	}
+
+	tp_base = bank ? 0x4000 : 0;
+	switch (tp_mbc)
+	{
+		case MBC_1:
+			// Banks 20h, 40h and 60h can only be seen at 0000h, in mode 1.
+			// 2000h first: the window then stays where the bank appears.
+			if (bank & 0x1f) {
+				tpak_queueWrite(0x2000, bank & 0x1f);
+			} else {
+				tp_base = 0;
+			}
+			tpak_queueWrite(0x4000, bank >> 5);
+			tpak_queueWrite(0x6000, bank && !(bank & 0x1f));
+			break;
+
+		case MBC_2:
+			if (bank)
+				tpak_queueWrite(0x2100, bank & 0x0f);
+			break;
+
+		case MBC_3:
+			if (bank)
+				tpak_queueWrite(0x2000, bank & 0x7f);
+			break;
+
+		case MBC_5:
+			if (bank) {
+				tpak_queueWrite(0x3000, bank >> 8);
+				tpak_queueWrite(0x2000, bank);
+			}
+			break;
+	}
+}
+
+/* \brief Read or write a block at a cartridge address.
+ *
+ * When the window must be moved first, that is all that is done and 2 is
+ * returned. Call again.
+ *
+ * \return As n64pak_readBlock(), or 2
+ */
+static char tpak_cartAccess(unsigned int cart_addr, unsigned char *buf, char write)
+{
+	unsigned char window = cart_addr >> 14;
+	unsigned int addr = TPAK_WINDOW_ADDR | (cart_addr & 0x3fff);
+	char res;
+
+	if (tp_window != window) {
+		memset(buf, window, 32);
+		res = n64pak_writeBlock(TPAK_BANK_ADDR, buf);
+		if (res == 0) {
+			tp_window = window;
+			return 2;
+		}
+		return res;
+	}
+
+	if (write)
+		return n64pak_writeBlock(addr, buf);
+
+	return n64pak_readBlock(addr, buf);
+}
+
+/* \return 0 if the step may be repeated or the next one done */
+static char tpak_result(char res)
+{
+	if (res == 0) {
+		tp_tries = 0;
+		return 0;
+	}
+	if (res == 2)
+		return 0;
+
+	if (res > 0) {
+		tpak_fail(TPAK_ST_NO_TPAK);
+		return 1;
+	}
+
+	tp_retries++;
+	if (++tp_tries > TPAK_RETRIES) {
+		tpak_fail(TPAK_ST_ERROR);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* \brief One transaction with the transfer pak, or a change of state.
+ * \return 0 if there is more to do, 1 to wait (for the host, or the
+ *         next poll)
+ */
+static char tpak_step(void)
+{
+	unsigned char *chunk = tp_chunk[tp_fill];
+	unsigned char *dst;
+	unsigned int addr;
+	char res;
+
+	// Everything goes through the next block of the chunk being filled
+	if (tp_chunk_state[tp_fill] != CHUNK_FREE)
+		return 1;
+	dst = chunk + TPAK_HEADER_SIZE + tp_fill_blocks * 32;
+
+	if (tp_write_next < tp_writes) {
+		memset(dst, tp_write_val[tp_write_next], 32);
+		res = tpak_cartAccess(tp_write_addr[tp_write_next], dst, 1);
+		if (res == 0)
+			tp_write_next++;
+		return tpak_result(res);
+	}
+
+	switch (tp_step)
+	{
+		case TP_POWER:
+			memset(dst, TPAK_POWER_ON, 32);
+			res = n64pak_writeBlock(TPAK_POWER_ADDR, dst);
+			if (res == 0)
+				tp_step = TP_CHECK;
+			return tpak_result(res);
+
+		case TP_CHECK:
+			res = n64pak_readBlock(TPAK_POWER_ADDR, dst);
+			if (res == 0) {
+				if (dst[0] != TPAK_POWER_ON) {
+					// Rumble pak, controller pak...
+					tpak_fail(TPAK_ST_NO_TPAK);
+					return 1;
+				}
+				tp_step = TP_ACCESS;
+			}
+			return tpak_result(res);
+
+		case TP_ACCESS:
+			memset(dst, TPAK_ACCESS_ON, 32);
+			res = n64pak_writeBlock(TPAK_STATUS_ADDR, dst);
+			if (res == 0) {
+				tp_step = TP_STATUS;
+				tp_attempts = 0;
+			}
+			return tpak_result(res);
+
+		case TP_STATUS:
+			res = n64pak_readBlock(TPAK_STATUS_ADDR, dst);
+			if (res == 0) {
+				if (dst[0] & TPAK_STATUS_REMOVED) {
+					tpak_fail(TPAK_ST_NO_CART);
+					return 1;
+				}
+				if (!(dst[0] & TPAK_STATUS_READY)) {
+					if (++tp_attempts >= TPAK_READY_ATTEMPTS) {
+						tpak_fail(TPAK_ST_NO_CART);
+					}
+					return 1; // Try again after the next poll
+				}
+				tp_step = TP_HEADER;
+			}
+			return tpak_result(res);
+
+		case TP_HEADER:
+			res = tpak_cartAccess(0x0140, dst, 0);
+			if (res == 0) {
+				memcpy(tp_header, dst + 7, 3);
+				tp_mbc = tpak_mbcType(tp_header[0]);
+				tp_bank = 0xffff;
+
+				if (tp_target == TPAK_CMD_RAM) {
+					tp_size = tpak_ramSize();
+					tpak_queueWrite(0x0000, 0x0A); // RAM enable
+					tp_ram_enabled = 1;
+				} else {
+					if (tp_header[1] > 8) {
+						// Garbage. Not inserted properly?
+						tpak_fail(TPAK_ST_NO_CART);
+						return 1;
+					}
+					tp_size = 0x8000UL << tp_header[1];
+				}
+				tp_step = TP_DUMP;
+			}
+			return tpak_result(res);
+
+		case TP_DUMP:
+			if (tp_offset >= tp_size) {
+				tp_step = TP_FINISH;
+				return 0;
+			}
+
+			if (tp_target == TPAK_CMD_RAM) {
+				if (tp_bank != (tp_offset >> 13)) {
+					tpak_selectBank(tp_offset >> 13);
+					return 0;
+				}
+				addr = tp_base + (tp_offset & 0x1fff);
+			} else {
+				if (tp_bank != (tp_offset >> 14)) {
+					tpak_selectBank(tp_offset >> 14);
+					return 0;
+				}
+				addr = tp_base + (tp_offset & 0x3fff);
+			}
+
+			res = tpak_cartAccess(addr, dst, 0);
+			if (res == 0) {
+				if (!tp_fill_blocks) {
+					chunk[1] = TPAK_ST_DATA;
+					chunk[2] = tp_port;
+					chunk[3] = tp_offset;
+					chunk[4] = tp_offset >> 8;
+					chunk[5] = tp_offset >> 16;
+				}
+				tp_offset += 32;
+				if (++tp_fill_blocks >= TPAK_CHUNK_BLOCKS) {
+					tp_chunk_state[tp_fill] = CHUNK_READY;
+					tp_fill ^= 1;
+					tp_fill_blocks = 0;
+				}
+			}
+			return tpak_result(res);
+
+		case TP_FINISH:
+			if (tp_ram_enabled) {
+				// Protect the save from what follows (power off, removal)
+				tp_ram_enabled = 0;
+				tpak_queueWrite(0x0000, 0x00);
+				return 0;
+			}
+
+			memset(dst, TPAK_POWER_OFF, 32);
+			n64pak_writeBlock(TPAK_POWER_ADDR, dst);
+			tp_step = TP_IDLE;
+			if (tp_status == TPAK_ST_BUSY)
+				tp_status = TPAK_ST_IDLE;
+			return 1;
+	}
+
+	return 1;
+}
+
+/* \brief A SET of the transfer pak report, from the host.
+ * \return 0 if accepted, -1 to refuse it (STALL)
+ */
+char tpak_request(const unsigned char *report, unsigned char len)
+{
+	unsigned long offset;
+
+	if (len < TPAK_HEADER_SIZE || report[2] >= GCN64_NUM_PORTS)
+		return -1;
+
+	offset = report[3] | ((unsigned int)report[4] << 8) | ((unsigned long)report[5] << 16);
+	offset &= ~(TPAK_CHUNK_BLOCKS * 32UL - 1);
+
+	switch (report[1])
+	{
+		case TPAK_CMD_STOP:
+			tp_writes = tp_write_next = 0;
+			tpak_dropChunks();
+			if (tp_step == TP_IDLE || tp_step == TP_CHECK) {
+				tp_step = TP_IDLE;
+				tp_status = TPAK_ST_IDLE;
+			} else {
+				tp_step = TP_FINISH;
+				tp_status = TPAK_ST_BUSY;
+			}
+			return 0;
+
+		case TPAK_CMD_ROM:
+		case TPAK_CMD_RAM:
+			if (tp_step == TP_DUMP && report[1] == tp_target && report[2] == tp_port) {
+				// Start over from there (a chunk was lost)
+				tp_writes = tp_write_next = 0;
+				tp_bank = 0xffff;
+				tpak_dropChunks();
+				tp_offset = offset;
+				return 0;
+			}
+			if (tp_step != TP_IDLE)
+				return -1;
+
+			tp_target = report[1];
+			tp_port = report[2];
+			tp_writes = tp_write_next = 0;
+			tp_offset = offset;
+			tp_size = 0;
+			tp_status = TPAK_ST_BUSY;
+			tp_tries = 0;
+			tp_retries = 0;
+			tp_window = 0xff;
+			tp_ram_enabled = 0;
+			memset(tp_header, 0, sizeof(tp_header));
+			tpak_dropChunks();
+			tp_step = TP_POWER;
+			return 0;
+	}
+
+	return -1;
+}
+
+/* \brief A GET of the transfer pak report, from the host.
+ *
+ * Except for byte 0 (the report ID), the report is written to *report or,
+ * when a chunk is ready, *report is pointed to it.
+ *
+ * \return The report length
+ */
+unsigned char tpak_getReport(unsigned char **report)
+{
+	unsigned char *r = *report;
+	unsigned long offset;
+	unsigned char i;
+
+	// The previous control transfer is over
+	for (i=0; i<2; i++) {
+		if (tp_chunk_state[i] == CHUNK_SENT)
+			tp_chunk_state[i] = CHUNK_FREE;
+	}
+
+	// The chunk being filled is the oldest when both are ready
+	i = tp_chunk_state[tp_fill] == CHUNK_READY ? tp_fill : tp_fill ^ 1;
+	if (tp_chunk_state[i] == CHUNK_READY) {
+		tp_chunk_state[i] = CHUNK_SENT;
+		*report = tp_chunk[i];
+		return TPAK_REPORT_SIZE;
+	}
+
+	offset = tp_status == TPAK_ST_ERROR ? tp_err_offset : tp_offset;
+
+	r[1] = tp_status;
+	r[2] = tp_port;
+	r[3] = offset;
+	r[4] = offset >> 8;
+	r[5] = offset >> 16;
+	memcpy(r + 6, tp_header, 3);
+	r[9] = tp_size;
+	r[10] = tp_size >> 8;
+	r[11] = tp_size >> 16;
+	r[12] = tp_retries;
+	r[13] = tp_retries >> 8;
+
+	return TPAK_INFO_SIZE;
+}
+
+/* \brief Transfer pak work, if any on the current port.
+ * Called from n64AfterPoll().
+ * \return Non-zero if the transfer pak is in use
+ */
+char tpak_doTask(void)
+{
+	if (tp_step == TP_IDLE || gcn64_getPort() != tp_port)
+		return 0;
+
+	// Back to back, while it fits before the next USB interrupt
+	while (!tpak_step()) {
+		if (sched_timeLeft() < TPAK_STEP_CYCLES)
+			break;
+	}
+
+	// Even when waiting for the host: rumble writes must not reach the
+	// transfer pak.
+	return 1;
+}
@@ -0,0 +1,42 @@
+#ifndef _tpak_h__
+#define _tpak_h__
+
+/* Game Boy cartridge dumps through a N64 transfer pak, driven by the host
+ * through vendor feature report 17h. See tpak.c */
+
+/* Blocks (32 bytes) per report. Two reports worth of RAM are used. Must
+ * divide 512 (the smallest cartridge RAM). */
+#ifndef TPAK_CHUNK_BLOCKS
+#define TPAK_CHUNK_BLOCKS	2
+#endif
+
+/* Byte 1 of the report, written by the host */
+#define TPAK_CMD_STOP		0	// abort, power the transfer pak off
+#define TPAK_CMD_ROM		1	// dump the cartridge ROM from the offset
+#define TPAK_CMD_RAM		2	// dump the cartridge RAM from the offset
+
+/* Byte 1 of the report, read by the host */
+#define TPAK_ST_IDLE		0	// nothing in progress, or dump complete
+#define TPAK_ST_BUSY		1	// no chunk ready yet
+#define TPAK_ST_DATA		2	// the chunk at the offset follows
+#define TPAK_ST_ERROR		3	// failed at the offset. Send STOP to clear.
+#define TPAK_ST_NO_TPAK		4	// no transfer pak on the controller
+#define TPAK_ST_NO_CART		5	// no cartridge in the transfer pak
+
+/* ID, command/status, port, offset (24 bit, little endian), then either
+ * the chunk (DATA) or, for other statuses:
+ *   6: Cartridge type (header byte 147h)
+ *   7: ROM size code (148h)
+ *   8: RAM size code (149h)
+ *   9-11: Size of what is being dumped, in bytes
+ *   12-13: Blocks read again after a CRC error or no reply
+ */
+#define TPAK_HEADER_SIZE	6
+#define TPAK_INFO_SIZE		14
+#define TPAK_REPORT_SIZE	(TPAK_HEADER_SIZE + TPAK_CHUNK_BLOCKS * 32)
+
+char tpak_request(const unsigned char *report, unsigned char len);
+unsigned char tpak_getReport(unsigned char **report);
+char tpak_doTask(void);
+
+#endif // _tpak_h__
@@ -0,0 +1,260 @@
+/*	gc_n64_usb : Gamecube or N64 controller to USB firmware
+	Copyright (C) 2007-2014  Raphael Assenat <raph@raphnet.net>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <linux/hidraw.h>
+
+/* See usbconfig.h */
+#define ADAPTER_VID		0xF055
+#define ADAPTER_PID		0x1764
+
+/* See main.c and tpak.h */
+#define GCN64_TPAK_REPORT	0x17
+#define TPAK_HEADER_SIZE	6
+#define MAX_REPORT_SIZE		(TPAK_HEADER_SIZE + 16 * 32)
+#define MAX_CART_SIZE		0x800000
+
+#define TPAK_CMD_STOP		0
+#define TPAK_CMD_ROM		1
+#define TPAK_CMD_RAM		2
+
+#define TPAK_ST_IDLE		0
+#define TPAK_ST_BUSY		1
+#define TPAK_ST_DATA		2
+#define TPAK_ST_ERROR		3
+#define TPAK_ST_NO_TPAK		4
+#define TPAK_ST_NO_CART		5
+
+/* Give up when the adapter makes no progress for this long */
+#define TIMEOUT_MS			3000
+
+static int port;
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-p port] rom|ram file /dev/hidrawX\n", progname);
+	fprintf(stderr, "  -p  Controller port (1 to 4), for adapters with several ports\n");
+}
+
+static long msNow(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+}
+
+static int sendCommand(int fd, int cmd, unsigned long offset)
+{
+	unsigned char buf[TPAK_HEADER_SIZE];
+
+	buf[0] = GCN64_TPAK_REPORT;
+	buf[1] = cmd;
+	buf[2] = port;
+	buf[3] = offset;
+	buf[4] = offset >> 8;
+	buf[5] = offset >> 16;
+
+	if (ioctl(fd, HIDIOCSFEATURE(sizeof(buf)), buf) < 0) {
+		perror("HIDIOCSFEATURE");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int dump(int fd, int cmd, unsigned char *image, unsigned long *size)
+{
+	unsigned char buf[MAX_REPORT_SIZE];
+	unsigned long expected = 0, offset, last_shown = 0;
+	long start = msNow(), last = start, ms;
+	int res, len, retries = 0;
+
+	*size = 0;
+	if (sendCommand(fd, cmd, 0))
+		return -1;
+
+	while (1) {
+		memset(buf, 0, sizeof(buf));
+		buf[0] = GCN64_TPAK_REPORT;
+		res = ioctl(fd, HIDIOCGFEATURE(sizeof(buf)), buf);
+		if (res < 0) {
+			perror("HIDIOCGFEATURE");
+			return -1;
+		}
+		if (res < 14) {
+			fprintf(stderr, "\nShort report (%d bytes). Old firmware?\n", res);
+			return -1;
+		}
+
+		offset = buf[3] | (buf[4] << 8) | (buf[5] << 16);
+
+		switch (buf[1])
+		{
+			case TPAK_ST_DATA:
+				len = res - TPAK_HEADER_SIZE;
+				if (offset != expected) {
+					// A chunk was lost on the way. Read again from there.
+					if (sendCommand(fd, cmd, expected))
+						return -1;
+					break;
+				}
+				if (expected + len > MAX_CART_SIZE) {
+					fprintf(stderr, "\nMore data than expected\n");
+					return -1;
+				}
+				memcpy(image + expected, buf + TPAK_HEADER_SIZE, len);
+				expected += len;
+				last = msNow();
+				if (expected - last_shown >= 0x4000) {
+					last_shown = expected;
+					ms = last - start;
+					printf("\r%7lu / %lu bytes, %ld bytes/s, %d retries", expected, *size,
+							ms ? (long)(expected * 1000 / ms) : 0, retries);
+					fflush(stdout);
+				}
+				break;
+
+			case TPAK_ST_BUSY:
+				*size = buf[9] | (buf[10] << 8) | (buf[11] << 16);
+				retries = buf[12] | (buf[13] << 8);
+				if (msNow() - last > TIMEOUT_MS) {
+					fprintf(stderr, "\nTimeout. Is there a N64 controller on this port?\n");
+					return -1;
+				}
+				// Leave the bus quiet while the adapter reads the cartridge
+				usleep(1000);
+				break;
+
+			case TPAK_ST_IDLE:
+				*size = buf[9] | (buf[10] << 8) | (buf[11] << 16);
+				retries = buf[12] | (buf[13] << 8);
+				ms = msNow() - start;
+				printf("\r%7lu / %lu bytes, %ld bytes/s, %d retries\n", expected, *size,
+							ms ? (long)(expected * 1000 / ms) : 0, retries);
+				printf("Cartridge type %02xh, ROM size code %02xh, RAM size code %02xh\n",
+							buf[6], buf[7], buf[8]);
+				if (expected != *size) {
+					fprintf(stderr, "Incomplete\n");
+					return -1;
+				}
+				return 0;
+
+			case TPAK_ST_NO_TPAK:
+				fprintf(stderr, "\nNo transfer pak on this controller\n");
+				return -1;
+
+			case TPAK_ST_NO_CART:
+				fprintf(stderr, "\nNo cartridge in the transfer pak\n");
+				return -1;
+
+			default:
+				fprintf(stderr, "\nFailed at offset 0x%06lx\n", offset);
+				return -1;
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct hidraw_devinfo info;
+	static unsigned char image[MAX_CART_SIZE];
+	const char *action, *filename, *device;
+	unsigned long size;
+	FILE *fptr;
+	int opt, fd, res, cmd;
+
+	while ((opt = getopt(argc, argv, "p:h")) != -1) {
+		switch (opt)
+		{
+			case 'p':
+				port = atoi(optarg) - 1;
+				if (port < 0 || port > 3) {
+					fprintf(stderr, "Invalid port\n");
+					return 1;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind + 3 != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	action = argv[optind];
+	filename = argv[optind + 1];
+	device = argv[optind + 2];
+
+	if (!strcmp(action, "rom")) {
+		cmd = TPAK_CMD_ROM;
+	} else if (!strcmp(action, "ram")) {
+		cmd = TPAK_CMD_RAM;
+	} else {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror(device);
+		return 1;
+	}
+
+	if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0) {
+		perror("HIDIOCGRAWINFO");
+		close(fd);
+		return 1;
+	}
+	if ((info.vendor & 0xffff) != ADAPTER_VID || (info.product & 0xffff) != ADAPTER_PID) {
+		fprintf(stderr, "%s is not a GC/N64 to USB adapter (%04x:%04x)\n",
+					device, info.vendor & 0xffff, info.product & 0xffff);
+		close(fd);
+		return 1;
+	}
+
+	res = dump(fd, cmd, image, &size);
+	if (res) {
+		// Power the transfer pak off
+		sendCommand(fd, TPAK_CMD_STOP, 0);
+	} else if (size == 0) {
+		printf("Nothing to save: This cartridge has no RAM\n");
+	} else {
+		fptr = fopen(filename, "wb");
+		if (!fptr) {
+			perror(filename);
+			res = -1;
+		} else {
+			if (fwrite(image, 1, size, fptr) != size) {
+				perror(filename);
+				res = -1;
+			}
+			fclose(fptr);
+		}
+	}
+
+	close(fd);
+
+	return res ? 1 : 0;
+}
@@ -80,7 +80,13 @@ section at the end of this file).
  * default control endpoint 0 and an interrupt-in endpoint (any other endpoint
  * number).
  */
+/* The single port adapter also has a keyboard interface (see main.c),
+ * on endpoint 3. */
+#if !defined(GCN64_NUM_PORTS) || GCN64_NUM_PORTS == 1
+#define USB_CFG_HAVE_INTRIN_ENDPOINT3   1
+#else
 #define USB_CFG_HAVE_INTRIN_ENDPOINT3   0
+#endif
 /* Define this to 1 if you want to compile a version with three endpoints: The
  * default control endpoint 0, an interrupt-in endpoint 3 (or the number
  * configured below) and a catch-all default interrupt-in endpoint as above.